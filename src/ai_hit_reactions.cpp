@@ -232,13 +232,7 @@ void HitReactions::AskForHelp(Unit *own, Unit *enemy, bool attacking_military)
         helping_workers.emplace_back(nullptr);
         AskForHelp_CheckUnits(own, enemy, attacking_military, helping_workers.data());
     }
-    Unit **units = own->nearby_helping_units.load(std::memory_order_relaxed);
-    while (units == nullptr)
-    {
-        STATIC_PERF_CLOCK(Ai_AskForHelp_Hang);
-        SwitchToThread(); // Bad?
-        units = own->nearby_helping_units.load(std::memory_order_relaxed);
-    }
+    Unit **units = WaitNearbyHelpingUnits(own);
     AskForHelp_CheckUnits(own, enemy, attacking_military, units);
 }
 
@@ -28,6 +28,8 @@
 #include "warn.h"
 #include "unit_cache.h"
 #include "damage_calculation.h"
+#include "splash_distance.h"
+#include "slab_allocator.h"
 #include "strings.h"
 #include "entity.h"
 
@@ -80,28 +82,61 @@ static void UnitKilled(Unit *target, Unit *attacker, int attacking_player, vecto
 
 bool DamagedUnit::IsDead() const
 {
-    return base->dmg_unit.damage >= base->hitpoints;
+    return (*table)[index].damage >= base->hitpoints;
 }
 
 void DamagedUnit::AddDamage(int amt)
 {
-    base->dmg_unit.damage += amt;
+    (*table)[index].damage += amt;
 }
 
 int32_t DamagedUnit::GetDamage()
 {
-    return base->dmg_unit.damage;
+    return (*table)[index].damage;
 }
 
-DamagedUnit ProgressBulletBufs::GetDamagedUnit(Unit *unit)
+void DamagedUnitTable::Clear()
+{
+    entries.clear();
+    std::fill(slots.begin(), slots.end(), 0);
+}
+
+void DamagedUnitTable::Grow()
+{
+    slot_shift = slot_shift == 0 ? 8 : slot_shift + 1;
+    slots.clear();
+    slots.resize(1 << slot_shift, 0);
+    uint32_t mask = slots.size() - 1;
+    for (uint32_t i = 0; i < entries.size(); i++)
+    {
+        uint32_t slot = Slot(entries[i].unit->lookup_id);
+        while (slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        slots[slot] = i + 1;
+    }
+}
+
+uint32_t DamagedUnitTable::Get(Unit *unit)
 {
-    if (unit->dmg_unit.valid_frame != *bw::frame_count)
+    if ((entries.size() + 1) * 2 > slots.size())
+        Grow();
+    uint32_t mask = slots.size() - 1;
+    uint32_t slot = Slot(unit->lookup_id);
+    while (slots[slot] != 0)
     {
-        unit->dmg_unit.damage = 0;
-        unit->dmg_unit.valid_frame = *bw::frame_count;
-        damaged_units->emplace_back(unit);
+        uint32_t index = slots[slot] - 1;
+        if (entries[index].unit == unit)
+            return index;
+        slot = (slot + 1) & mask;
     }
-    return DamagedUnit(unit);
+    slots[slot] = entries.size() + 1;
+    entries.emplace_back(unit);
+    return entries.size() - 1;
+}
+
+DamagedUnit ProgressBulletBufs::GetDamagedUnit(Unit *unit)
+{
+    return DamagedUnit(unit, damaged_units, damaged_units->Get(unit));
 }
 
 /// Convenience function for DamageCalculation class which can be annoying
@@ -205,6 +240,18 @@ void Bullet::Move(const Point &where)
     MoveSprite(sprite.get(), where.x, where.y);
 }
 
+static SlabAllocator bullet_allocator("Bullet", sizeof(Bullet));
+
+void *Bullet::operator new(size_t size)
+{
+    return bullet_allocator.Allocate(size);
+}
+
+void Bullet::operator delete(void *ptr)
+{
+    bullet_allocator.Free(ptr);
+}
+
 // Spawner is not necessarily parent, in case of subunits/fighters
 bool Bullet::Initialize(Unit *spawner, int player_, int direction, int weapon, const Point &pos)
 {
@@ -591,9 +638,7 @@ bool UnitWasHit_Actual(Unit *target, Unit *attacker, ProgressBulletBufs *bufs)
 
     if (!target->ai)
     {
-        Unit **nearby = target->nearby_helping_units.load(std::memory_order_relaxed);
-        while (!nearby)
-            nearby = target->nearby_helping_units.load(std::memory_order_relaxed);
+        Unit **nearby = WaitNearbyHelpingUnits(target);
 
         bool ai_player = IsComputerPlayer(target->player);
 
@@ -907,12 +952,13 @@ vector<Unit *> BulletSystem::ProcessUnitWasHit(vector<tuple<Unit *, Unit *>> hit
 // DamagedUnits() does not need to return synced vec?
 void BulletSystem::ProcessHits(ProgressBulletBufs *bufs)
 {
-    for (auto &dmg_unit : *bufs->DamagedUnits())
+    STATIC_PERF_CLOCK(BulletSystem_ProcessHits);
+    for (const auto &entry : bufs->DamagedUnits()->Entries())
     {
-        Unit *unit = dmg_unit.base;
-        if (!dmg_unit.IsDead())
+        Unit *unit = entry.unit;
+        if (entry.damage < unit->hitpoints)
         {
-            unit->hitpoints -= dmg_unit.GetDamage();
+            unit->hitpoints -= (int32_t)entry.damage;
             if (images_dat_damage_overlay[unit->sprite->main_image->image_id] &&
                     unit->flags & UnitStatus::Completed)
             {
@@ -953,6 +999,53 @@ void Bullet::NormalHit(ProgressBulletBufs *bufs)
     }
 }
 
+// Collision boxes of the units found by Bullet::Splash, and their distances to the bullet.
+// Only used from the main thread.
+struct SplashBoxes
+{
+    vector<int32_t> left;
+    vector<int32_t> top;
+    vector<int32_t> right;
+    vector<int32_t> bottom;
+    vector<int32_t> x_dist;
+    vector<int32_t> y_dist;
+
+    void Calculate(Unit **units, int count, const Point &pos)
+    {
+        left.resize(count);
+        top.resize(count);
+        right.resize(count);
+        bottom.resize(count);
+        x_dist.resize(count);
+        y_dist.resize(count);
+        for (int i = 0; i < count; i++)
+        {
+            const Unit *unit = units[i];
+            const auto &box = units_dat_dimensionbox[unit->unit_id];
+            left[i] = unit->sprite->position.x - box.left;
+            right[i] = unit->sprite->position.x + box.right - 1;
+            top[i] = unit->sprite->position.y - box.top;
+            bottom[i] = unit->sprite->position.y + box.bottom - 1;
+        }
+        SplashAxisDistances(left.data(), top.data(), right.data(), bottom.data(), count, pos.x, pos.y,
+                x_dist.data(), y_dist.data());
+    }
+    // Distance() is never less than the distance along either axis
+    bool IsOutside(int pos, int max_dist) const
+    {
+        return x_dist[pos] > max_dist || y_dist[pos] > max_dist;
+    }
+    // Same as GetSplashDistance
+    int Distance(int pos) const
+    {
+        if (x_dist[pos] == 0 && y_dist[pos] == 0)
+            return 0;
+        return ::Distance(Point32(0, 0), Point32(x_dist[pos], y_dist[pos]));
+    }
+};
+
+static SplashBoxes splash_boxes;
+
 template <bool air_splash>
 void Bullet::Splash(ProgressBulletBufs *bufs, bool hit_own_units)
 {
@@ -962,6 +1055,9 @@ void Bullet::Splash(ProgressBulletBufs *bufs, bool hit_own_units)
     int unit_amount;
     Unit **units, **units_beg;
     units = units_beg = unit_search->FindUnitsRect(splash_area, &unit_amount);
+    // The boxes and distances of every unit are calculated at once, and units which are clearly
+    // too far are skipped before anything else. Hits are still done in the search order.
+    splash_boxes.Calculate(units_beg, unit_amount, sprite->position);
     bool hit_orig = false;
     bool storm = weapon_id == Weapon::PsiStorm;
     Unit **rand_fulldmg_pos = units;
@@ -969,13 +1065,16 @@ void Bullet::Splash(ProgressBulletBufs *bufs, bool hit_own_units)
     {
         for (Unit *unit = *units++; unit; unit = *units++)
         {
+            int pos = units - 1 - units_beg;
+            if (splash_boxes.IsOutside(pos, outer_splash))
+                continue;
             if (!hit_own_units && unit->player == player && unit != target)
                 continue;
             if (!CanHitUnit(unit, unit, weapon_id))
                 continue;
             if (!storm && unit == parent)
                 continue;
-            int distance = GetSplashDistance(this, unit);
+            int distance = splash_boxes.Distance(pos);
             if (distance > outer_splash)
                 continue;
             if (storm)
@@ -1014,13 +1113,16 @@ void Bullet::Splash(ProgressBulletBufs *bufs, bool hit_own_units)
     {
         for (Unit *unit = *units++; unit; unit = *units++)
         {
+            int pos = units - 1 - units_beg;
+            if (splash_boxes.IsOutside(pos, outer_splash))
+                continue;
             if (!hit_own_units && unit->player == player && unit != target)
                 continue;
             if (!CanHitUnit(unit, unit, weapon_id))
                 continue;
             if (!storm && unit == parent)
                 continue;
-            int distance = GetSplashDistance(this, unit);
+            int distance = splash_boxes.Distance(pos);
             if (distance > outer_splash)
                 continue;
             if (storm)
@@ -1353,10 +1455,23 @@ Claimed<BulletStateResults> BulletSystem::ProgressStates()
     }
 
     ProgressBulletsForState(&initstate, results_ptr, BulletState::Init, &Bullet::State_Init);
+    // The movement states cannot be progressed in parallel, as bw's flingy movement
+    // (ProgressBulletMovement, ChangeMovePos) passes its results through globals and
+    // MoveSprite relinks the sprite in shared lists. They are timed separately to see
+    // how much of the frame they take.
+    PerfClock movement_clock;
+    if (PerfTest)
+        movement_stats.bullets = moving_to_point.size() + moving_to_unit.size() + moving_near.size();
     ProgressBulletsForState(&moving_to_point, results_ptr, BulletState::MoveToPoint, &Bullet::State_MoveToPoint);
     ProgressBulletsForState(&moving_to_unit, results_ptr, BulletState::MoveToTarget, &Bullet::State_MoveToUnit);
+    if (PerfTest)
+        movement_stats.time = movement_clock.GetTime();
     ProgressBulletsForState(&damage_ground, results_ptr, BulletState::GroundDamage, &Bullet::State_GroundDamage);
+    if (PerfTest)
+        movement_clock.Start();
     ProgressBulletsForState(&moving_near, results_ptr, BulletState::MoveNearUnit, &Bullet::State_MoveNearUnit);
+    if (PerfTest)
+        movement_stats.time += movement_clock.GetTime();
     ProgressBulletsForState(&bouncing, results_ptr, BulletState::Bounce, &Bullet::State_Bounce);
 
     return results;
@@ -1397,9 +1512,12 @@ void BulletSystem::ProcessAiReactToHit(vector<tuple<Unit *, Unit *, bool>> input
 void BulletSystem::ProgressFrames(BulletFramesInput input)
 {
     StaticPerfClock::ClearWithLog("Bullet::ProgressFrames");
-    unsigned int prev_sleep = 0;
+    unsigned int prev_sleep = 0, prev_steal = 0;
     if (PerfTest)
+    {
         prev_sleep = threads->GetSleepCount();
+        prev_steal = threads->GetStealCount();
+    }
     PerfClock clock, clock2;
 
     auto state_results = ProgressStates();
@@ -1410,7 +1528,7 @@ void BulletSystem::ProgressFrames(BulletFramesInput input)
     auto ai_react = ai_react_buf.Claim();
     auto killed_units = killed_units_buf.Claim();
     ProgressBulletBufs bufs(&dmg_units.Inner(), &unit_was_hit.Inner(), &ai_react.Inner(), &killed_units.Inner());
-    dmg_units->clear();
+    dmg_units->Clear();
     spells->clear();
     killed_units->clear();
     bulletframes_in_progress = true;
@@ -1438,6 +1556,8 @@ void BulletSystem::ProgressFrames(BulletFramesInput input)
         HallucinationHit(i.target, i.attacker, i.direction, bufs.unit_was_hit);
     }
     ProcessHits(&bufs);
+    // Start the remaining searches before anything needs their results
+    FlushHelperSearches();
     auto ph_time = clock.GetTime();
     clock.Start();
 
@@ -1452,9 +1572,12 @@ void BulletSystem::ProgressFrames(BulletFramesInput input)
 
     // Sync with child threads. It is possible (but very unlikely) for a child be still busy,
     // if this thread did not want to wait for its result and did the search itself.
+    // Searches which are still queued get discarded, Unit::Kill will do them if needed.
+    FlushHelperSearches();
     threads->ClearAll();
     pbf_memory.ClearAll();
     threads->ForEachThread([](ScThreadVars *vars) { vars->unit_search_pool.ClearAll(); });
+    ClearCallerThreadVars();
     unit_search->valid_region_cache = false;
     unit_search->DisableAreaCache();
     bulletframes_in_progress = false;
@@ -1494,7 +1617,24 @@ void BulletSystem::ProgressFrames(BulletFramesInput input)
     }
 
     perf_log->Log("Pbf: %f ms + Ph %f ms + Puwh %f ms + Ahr %f ms + Clean %f ms = about %f ms\n", pbf_time, ph_time, puwh_time, ahr_time, clock.GetTime(), clock2.GetTime());
-    perf_log->Log("Sleep count: %d\n", threads->GetSleepCount() - prev_sleep);
+    perf_log->Log("Sleep count: %d, steal count: %d\n", threads->GetSleepCount() - prev_sleep,
+            threads->GetStealCount() - prev_steal);
+    auto helper_stats = TakeHelperSearchStats();
+    perf_log->Log("Helper searches: %d in %d tasks, %d done by main thread\n", helper_stats.searches,
+            helper_stats.tasks, helper_stats.main_thread);
+    auto area_cache_stats = unit_search->TakeAreaCacheStats();
+    perf_log->Log("Area cache: %d areas searched, %d filled, %d invalidated, %d full clears\n",
+            area_cache_stats.areas_found, area_cache_stats.areas_filled, area_cache_stats.areas_invalidated,
+            area_cache_stats.full_clears);
+    auto pair_stats = unit_search->TakeCollisionPairStats();
+    perf_log->Log("Collision pairs: %d in %d sweeps (%d skipped, %d dropped), %d searches used them, %d did not\n",
+            pair_stats.pairs, pair_stats.sweeps, pair_stats.skipped_sweeps, pair_stats.dropped,
+            pair_stats.searches, pair_stats.fallbacks);
+    perf_log->Log("Moving bullets: %d, %f ms\n", movement_stats.bullets, movement_stats.time);
+    perf_log->Log("Damaged units: %d, table has %d slots\n", (int)dmg_units->Entries().size(), dmg_units->SlotCount());
+    auto region_stats = unit_search->TakeRegionCacheStats();
+    perf_log->Log("ChooseTarget regions: %d searched, %d reused (%d resorted), %d invalidated\n",
+            region_stats.rebuilds, region_stats.reused, region_stats.resorts, region_stats.invalidated);
     perf_log->Indent(2);
     StaticPerfClock::LogCalls();
     perf_log->Indent(-2);
@@ -16,6 +16,23 @@ void RemoveFromBulletTargets(Unit *unit);
 bool UnitWasHit(Unit *target, Unit *attacker, bool notify);
 
 Unit **FindNearbyHelpingUnits(Unit *unit, TempMemoryPool *allocation_pool);
+// Units passed to Unit::StartHelperSearch are collected to batches, which are searched in
+// blocks of nearby units. Flushing hands the current batch to worker threads.
+void FlushHelperSearches();
+// Returns the result of Unit::StartHelperSearch. If no worker has started the search yet,
+// the calling thread (which has to be the main thread) does it itself.
+Unit **WaitNearbyHelpingUnits(Unit *unit);
+
+struct HelperSearchStats
+{
+    HelperSearchStats() : searches(0), tasks(0), main_thread(0) {}
+    int searches;
+    int tasks;
+    // Searches that the main thread had to do as the result was not ready
+    int main_thread;
+};
+// Only counted with PerfTest, resets the counters
+HelperSearchStats TakeHelperSearchStats();
 
 // Prefer DamagedUnit::AddHit or add more functionality to DamagedUnit as AddHit requires weapon_id
 // This is only for bw compatibility, or if you have really good reason to deal damage outside
@@ -114,10 +131,11 @@ struct ProgressBulletBufs;
 // There is also function DamageUnit() which should only be used when there is no attacker
 // (And preferably not even then, but otherwise burning/plague/etc damage would have to be passed to
 // BulletSystem::ProgressFrames(). The dead units are still passed there, so it might not even be worth it)
+class DamagedUnitTable;
 class DamagedUnit
 {
     public:
-        DamagedUnit(Unit *b) : base(b) {}
+        DamagedUnit(Unit *b, DamagedUnitTable *t, uint32_t i) : base(b), table(t), index(i) {}
         Unit *base;
 
         bool IsDead() const;
@@ -126,11 +144,49 @@ class DamagedUnit
 
     private:
         void AddDamage(int dmg);
+
+        DamagedUnitTable *table;
+        uint32_t index;
+};
+
+/// Hp damage of every unit damaged during one ProgressFrames call.
+/// The entries are in a dense array, in the order the units were first damaged, which is
+/// what ProcessHits goes through. An open addressing table keyed by lookup_id finds the
+/// entry of an unit, so nothing has to be stored in the units themselves.
+class DamagedUnitTable
+{
+    public:
+        struct Entry
+        {
+            Entry(Unit *u) : unit(u), damage(0) {}
+            Unit *unit;
+            uint32_t damage;
+        };
+
+        DamagedUnitTable() : slot_shift(0) {}
+        DamagedUnitTable(DamagedUnitTable &&other) = default;
+        DamagedUnitTable &operator=(DamagedUnitTable &&other) = default;
+
+        void Clear();
+        /// Returns index of the unit's entry, adding one with no damage if it does not exist
+        uint32_t Get(Unit *unit);
+        Entry &operator[](uint32_t index) { return entries[index]; }
+        const vector<Entry> &Entries() const { return entries; }
+        uint32_t SlotCount() const { return slots.size(); }
+
+    private:
+        uint32_t Slot(uint32_t lookup_id) const { return (lookup_id * 0x9e3779b1) >> (32 - slot_shift); }
+        void Grow();
+
+        vector<Entry> entries;
+        // Index + 1 of an entry, 0 if the slot is empty. Always at least twice as large as entries
+        vector<uint32_t> slots;
+        int slot_shift;
 };
 
 struct ProgressBulletBufs
 {
-    ProgressBulletBufs(vector<DamagedUnit> *a, vector<tuple<Unit *, Unit *>> *b,
+    ProgressBulletBufs(DamagedUnitTable *a, vector<tuple<Unit *, Unit *>> *b,
         vector<tuple<Unit *, Unit *, bool>> *c, vector<Unit *> *d) :
         unit_was_hit(b), ai_react(c), killed_units(d), damaged_units(a) {}
     ProgressBulletBufs(ProgressBulletBufs &&other) = default;
@@ -139,19 +195,15 @@ struct ProgressBulletBufs
     vector<tuple<Unit *, Unit *>> *unit_was_hit;
     vector<tuple<Unit *, Unit *, bool>> *ai_react;
     vector<Unit *> *killed_units;
-    vector<DamagedUnit> *damaged_units;
+    DamagedUnitTable *damaged_units;
     // Don't call help always false
     void AddToAiReact(Unit *unit, Unit *attacker, bool main_target_reactions);
 
     /// Returns DamagedUnit handle corresponding to the input unit.
     /// Handle is valid during the ongoing ProgressBulletFrames call,
     /// during which the same handle is always returned for unit
-    /// Current implementation just stores the data in unit struct with the frame it is valid for,
-    /// but "ideal" implementation would be some kind of Unit * -> DamagedUnit map.
-    /// As such calling another ProgressBulletFrames during same frame will not behave as expected,
-    /// even if there were completely separate BulletSystem
     DamagedUnit GetDamagedUnit(Unit *unit);
-    vector<DamagedUnit> *DamagedUnits() { return damaged_units; }
+    DamagedUnitTable *DamagedUnits() { return damaged_units; }
 };
 
 /// Results from Bullet::State_XYZ() that need to be handled later
@@ -253,6 +305,8 @@ class Bullet
         template <bool saving, class T> void SaveConvert(SaveBase<T> *save, const BulletSystem *parent);
         ~Bullet() {}
         Bullet(Bullet &&other) = default;
+        void *operator new(size_t size);
+        void operator delete(void *ptr);
 
         void WarnUnhandledIscriptCommand(const Iscript::Command &cmd, const char *func) const;
         std::string DebugStr() const;
@@ -279,8 +333,7 @@ class Bullet
 
 /// Contains and controls bullets of the game
 /// In theory, one could have multiple completely independed BulletSystems, but obviously it would
-/// require rewriting even more bw code - also ProgressBulletBufs::GetDamagedUnit has to be changed
-/// if that is ever desired
+/// require rewriting even more bw code
 class BulletSystem
 {
     typedef UnsortedList<ptr<Bullet>, 128> BulletContainer;
@@ -292,7 +345,7 @@ class BulletSystem
         template <class Cb>
         void MakeSaveIdMapping(Cb callback) const;
 
-        /// May only be called once per frame, see ProgressBulletBufs::GetDamagedUnit
+        /// May only be called once per frame
         void ProgressFrames(BulletFramesInput in);
         void DeleteAll();
         Bullet *AllocateBullet(Unit *parent, int player, int direction, int weapon, const Point &pos);
@@ -333,7 +386,14 @@ class BulletSystem
         BulletContainer damage_ground;
         BulletContainer moving_near;
         BulletContainer dying;
-        Claimable<vector<DamagedUnit>> dmg_unit_buf;
+        Claimable<DamagedUnitTable> dmg_unit_buf;
+        // Only with PerfTest, logged by ProgressFrames
+        struct MovementStats
+        {
+            MovementStats() : bullets(0), time(0.0) {}
+            int bullets;
+            double time;
+        } movement_stats;
         Claimable<vector<SpellCast>> spell_buf;
         // target, attacker
         Claimable<vector<tuple<Unit *, Unit *>>> unit_was_hit_buf;
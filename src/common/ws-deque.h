@@ -0,0 +1,129 @@
+#ifndef WS_DEQUE_H
+#define WS_DEQUE_H
+
+#include <atomic>
+#include <stdint.h>
+
+namespace Common
+{
+// Chase-Lev work stealing deque, with the memory orderings from
+// "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al.)
+// One owner pushes and pops at the bottom, any thread may steal from the top.
+// Indices are allowed to wrap around, only their difference is meaningful.
+template <class C>
+class WorkStealingDeque
+{
+    class Array
+    {
+        public:
+            Array(uint32_t size_, Array *prev_) : size(size_), mask(size_ - 1), prev(prev_)
+            {
+                entries = new C[size];
+            }
+            ~Array() { delete[] entries; }
+
+            C &Get(uint32_t pos) { return entries[pos & mask]; }
+
+            uint32_t size;
+            uint32_t mask;
+            C *entries;
+            // Old arrays are kept alive as stealers may still be reading them
+            Array *prev;
+    };
+
+    public:
+        WorkStealingDeque(uint32_t initial_size = 64)
+        {
+            const auto relaxed = std::memory_order_relaxed;
+            top.store(0, relaxed);
+            bottom.store(0, relaxed);
+            array.store(new Array(initial_size, nullptr), relaxed);
+        }
+
+        ~WorkStealingDeque()
+        {
+            Array *arr = array.load(std::memory_order_relaxed);
+            while (arr)
+            {
+                Array *prev = arr->prev;
+                delete arr;
+                arr = prev;
+            }
+        }
+
+        WorkStealingDeque(const WorkStealingDeque &other) = delete;
+
+        // Owner only
+        void push_back(const C &val)
+        {
+            uint32_t b = bottom.load(std::memory_order_relaxed);
+            uint32_t t = top.load(std::memory_order_acquire);
+            Array *arr = array.load(std::memory_order_relaxed);
+            if (b - t > arr->size - 1)
+                arr = Grow(arr, t, b);
+            arr->Get(b) = val;
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        // Owner only
+        bool pop_back(C *out)
+        {
+            uint32_t b = bottom.load(std::memory_order_relaxed) - 1;
+            Array *arr = array.load(std::memory_order_relaxed);
+            bottom.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint32_t t = top.load(std::memory_order_relaxed);
+            if ((int32_t)(b - t) < 0)
+            {
+                bottom.store(b + 1, std::memory_order_relaxed);
+                return false;
+            }
+            *out = arr->Get(b);
+            if (b != t)
+                return true;
+            // Last entry, race against stealers
+            bool success = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return success;
+        }
+
+        // Any thread. May fail spuriously if another thread took the entry simultaneously
+        bool steal(C *out)
+        {
+            uint32_t t = top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint32_t b = bottom.load(std::memory_order_acquire);
+            if ((int32_t)(b - t) <= 0)
+                return false;
+            Array *arr = array.load(std::memory_order_acquire);
+            C val = arr->Get(t);
+            if (top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed) == false)
+                return false;
+            *out = val;
+            return true;
+        }
+
+        bool empty() const
+        {
+            uint32_t t = top.load(std::memory_order_acquire);
+            uint32_t b = bottom.load(std::memory_order_acquire);
+            return (int32_t)(b - t) <= 0;
+        }
+
+    private:
+        Array *Grow(Array *arr, uint32_t t, uint32_t b)
+        {
+            Array *new_arr = new Array(arr->size * 2, arr);
+            for (uint32_t i = t; i != b; i++)
+                new_arr->Get(i) = arr->Get(i);
+            array.store(new_arr, std::memory_order_release);
+            return new_arr;
+        }
+
+        std::atomic<uint32_t> top;
+        std::atomic<uint32_t> bottom;
+        std::atomic<Array *> array;
+};
+}
+#endif /* WS_DEQUE_H */
@@ -0,0 +1,82 @@
+#include "cpu.h"
+
+#include <stdint.h>
+
+#ifdef __GNUC__
+#include <cpuid.h>
+#else
+#include <intrin.h>
+#endif
+
+namespace Cpu
+{
+
+struct Features
+{
+    Features();
+
+    bool sse2;
+    bool avx2;
+};
+
+static void CpuId(uint32_t leaf, uint32_t subleaf, uint32_t *regs)
+{
+#ifdef __GNUC__
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#else
+    __cpuidex((int *)regs, leaf, subleaf);
+#endif
+}
+
+static uint64_t GetXcr0()
+{
+#ifdef __GNUC__
+    uint32_t eax, edx;
+    asm volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0)); // xgetbv
+    return (uint64_t)edx << 32 | eax;
+#else
+    return _xgetbv(0);
+#endif
+}
+
+Features::Features()
+{
+    sse2 = false;
+    avx2 = false;
+    uint32_t regs[4];
+    CpuId(0, 0, regs);
+    uint32_t max_leaf = regs[0];
+    if (max_leaf < 1)
+        return;
+    CpuId(1, 0, regs);
+    sse2 = (regs[3] & (1 << 26)) != 0;
+    bool avx = (regs[2] & (1 << 28)) != 0;
+    bool osxsave = (regs[2] & (1 << 27)) != 0;
+    // The os has to save ymm registers as well
+    if (!avx || !osxsave || (GetXcr0() & 0x6) != 0x6)
+        return;
+    if (max_leaf < 7)
+        return;
+    CpuId(7, 0, regs);
+    avx2 = (regs[1] & (1 << 5)) != 0;
+}
+
+static Features features;
+static bool simd_disabled = false;
+
+bool HasSse2()
+{
+    return features.sse2 && !simd_disabled;
+}
+
+bool HasAvx2()
+{
+    return features.avx2 && !simd_disabled;
+}
+
+void DisableSimd(bool disable)
+{
+    simd_disabled = disable;
+}
+
+} // namespace Cpu
@@ -0,0 +1,23 @@
+#ifndef CPU_H
+#define CPU_H
+
+// Instruction set extensions that are selected at runtime.
+// The plugin itself is compiled for plain i686, so functions using the intrinsics
+// have to be marked with TARGET_SSE2/TARGET_AVX2 for gcc.
+namespace Cpu
+{
+    bool HasSse2();
+    bool HasAvx2();
+    // Allows comparing the vectorized and plain code paths (e.g. with the console)
+    void DisableSimd(bool disable);
+}
+
+#ifdef __GNUC__
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+#endif // CPU_H
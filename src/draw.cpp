@@ -5,10 +5,12 @@
 #include "patchmanager.h"
 #include "memory.h"
 #include <vector>
+#include <algorithm>
 #include "game.h"
 #include "yms.h"
 #include "log.h"
 #include "perfclock.h"
+#include "fog.h"
 
 std::atomic<uintptr_t> draw_counter;
 
@@ -147,87 +149,100 @@ int __stdcall SDrawUnlockSurface_Hook(int surface_id, uint8_t *surface, int a3,
     return (*bw::SDrawUnlockSurface_Import)(surface_id, surface, a3, a4);
 }
 
+static FogRule GetFogRule()
+{
+    FogRule rule;
+    rule.full_value = *bw::fog_variance_amount;
+    rule.half_value = rule.full_value / 2;
+    // Obviously people can just remove multiplayer check if they wish
+    // Bw had nice vision-based sync but it does not work with dynamically allocated sprites
+    if (all_visions && !IsMultiplayer())
+    {
+        rule.zero_test = { 0xff00, true };
+        rule.half_test = { 0xff, true };
+    }
+    else if (IsReplay())
+    {
+        if (*bw::replay_show_whole_map)
+        {
+            rule.zero_test = { 0, false };
+            rule.half_test = { 0, false };
+        }
+        else
+        {
+            rule.zero_test = { *bw::replay_visions << 8, true };
+            rule.half_test = { *bw::replay_visions, true };
+        }
+    }
+    else
+    {
+        rule.zero_test = { *bw::player_exploration_visions, false };
+        rule.half_test = { *bw::player_visions, false };
+    }
+    return rule;
+}
+
+// The flags and rule used by the previous GenerateFog call, if they are same,
+// the fog arrays already contain the result.
+static uint32_t prev_fog_flags[fog_width * fog_height];
+static FogRule prev_fog_rule;
+static uint8_t *prev_fog_arrays[2];
+
+void ClearGeneratedFog()
+{
+    prev_fog_arrays[0] = nullptr;
+    prev_fog_arrays[1] = nullptr;
+}
+
 void GenerateFog()
 {
+    STATIC_PERF_CLOCK(GenerateFog);
     int screen_x = *bw::screen_pos_x_tiles;
     if (screen_x != 0)
         screen_x--;
     int screen_y = *bw::screen_pos_y_tiles;
     if (screen_y != 0)
         screen_y--;
-    uint32_t *flags = (*bw::map_tile_flags) + screen_y * *bw::map_width_tiles + screen_x;
-    uint32_t *orig_flags = flags;
-    uint8_t *pos = *bw::fog_arr1;
-    int shown_value = *bw::fog_variance_amount;
-    int fow_value = shown_value / 2;
 
+    // Tiles outside map repeat the edge tiles. The first column is also repeated when the screen
+    // is at left edge, while the first row is not, as bw does it that way.
+    int columns[fog_width];
+    int x_pos = *bw::screen_pos_x_tiles - 1;
+    for (int i = 0, column = screen_x; i < fog_width; i++, x_pos++)
+    {
+        columns[i] = column;
+        if (x_pos < *bw::map_width_tiles - 1 && x_pos >= 0)
+            column++;
+    }
+    uint32_t flags[fog_width * fog_height];
+    const uint32_t *row = (*bw::map_tile_flags) + screen_y * *bw::map_width_tiles;
     int y_pos = screen_y;
-    for (int i = 0; i < 0x11; i++)
+    for (int i = 0; i < fog_height; i++, y_pos++)
     {
-        int x_pos = *bw::screen_pos_x_tiles - 1;
-        flags = orig_flags;
-        for (int i = 0; i < 0x18; i++)
-        {
-            // Obviously people can just remove multiplayer check if they wish
-            // Bw had nice vision-based sync but it does not work with dynamically allocated sprites
-            if (all_visions && !IsMultiplayer())
-            {
-                if ((0xff00 & flags[0]) == 0xff00)
-                    *pos = 0;
-                else if ((0xff & flags[0]) == 0xff)
-                    *pos = fow_value;
-                else
-                    *pos = shown_value;
-            }
-            else if (IsReplay())
-            {
-                if (*bw::replay_show_whole_map)
-                    *pos = shown_value;
-                else if (!((*bw::replay_visions << 8) & ~flags[0]))
-                    *pos = 0;
-                else if (!(*bw::replay_visions & ~flags[0]))
-                    *pos = fow_value;
-                else
-                    *pos = shown_value;
-            }
-            else
-            {
-                if (*bw::player_exploration_visions & flags[0])
-                    *pos = 0;
-                else if (*bw::player_visions & flags[0])
-                    *pos = fow_value;
-                else
-                    *pos = shown_value;
-            }
-            if (x_pos < *bw::map_width_tiles - 1 && x_pos >= 0)
-                flags++;
-            x_pos++;
-            pos++;
-        }
+        for (int j = 0; j < fog_width; j++)
+            flags[i * fog_width + j] = row[columns[j]];
         if (y_pos < *bw::map_height_tiles - 1 && y_pos >= 0)
-            orig_flags += *bw::map_width_tiles;
-        y_pos++;
+            row += *bw::map_width_tiles;
     }
 
-    // Blend fog
-    // Screen is 0x18 x 0x11 tiles
-    // Well every border has 1 nonvisible tile, it is only used for blending?
-    pos = *bw::fog_arr1 + 0x18 + 0x1;
-    uint8_t *out = *bw::fog_arr2 + 0x18 + 0x1;
-    for (int i = 0; i < 0x11 - 2; i++)
+    // The screen usually only changes when it is scrolled or vision changes
+    FogRule rule = GetFogRule();
+    if (rule == prev_fog_rule && prev_fog_arrays[0] == *bw::fog_arr1 && prev_fog_arrays[1] == *bw::fog_arr2 &&
+            std::equal(flags, flags + fog_width * fog_height, prev_fog_flags))
     {
-        for (int i = 0; i < 0x18 - 2; i++)
-        {
-            int val = pos[0] * 2;
-            val = (val + pos[-1] + pos[1] + pos[-0x18] + pos[0x18]) * 2;
-            val = (val + pos[-0x17] + pos[0x17] + pos[-0x19] + pos[0x19]) / 16;
-            *out = val;
-            pos++;
-            out++;
-        }
-        pos += 2;
-        out += 2;
+        return;
     }
+    std::copy(flags, flags + fog_width * fog_height, prev_fog_flags);
+    prev_fog_rule = rule;
+    prev_fog_arrays[0] = *bw::fog_arr1;
+    prev_fog_arrays[1] = *bw::fog_arr2;
+
+    for (int i = 0; i < fog_height; i++)
+        ClassifyFogLine(flags + i * fog_width, fog_width, rule, *bw::fog_arr1 + i * fog_width);
+
+    // Blend fog
+    // Every border has 1 nonvisible tile, it is only used for blending?
+    BlurFog(*bw::fog_arr1, *bw::fog_arr2, fog_width, fog_height);
 }
 
 void AddDrawHook(void (*func)(uint8_t *, xuint, yuint), int priority)
@@ -38,6 +38,9 @@ void PatchDraw(Common::PatchContext *patch);
 void AddDrawHook(void (*func)(uint8_t *, xuint, yuint), int priority);
 
 void GenerateFog();
+// GenerateFog skips the work if nothing has changed since last call, so this has to be called
+// when bw may have freed the fog arrays (and allocate new ones at the same address).
+void ClearGeneratedFog();
 
 extern std::atomic<uintptr_t> draw_counter;
 
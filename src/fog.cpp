@@ -0,0 +1,118 @@
+#include "fog.h"
+
+#include <emmintrin.h>
+
+#include "cpu.h"
+
+static void ClassifyFogLine_Scalar(const uint32_t *flags, unsigned int pos, unsigned int count,
+        const FogRule &rule, uint8_t *out)
+{
+    for (; pos < count; pos++)
+        out[pos] = rule.Value(flags[pos]);
+}
+
+TARGET_SSE2
+static inline __m128i FogTestMatches_Sse2(__m128i flags, const FogTest &test)
+{
+    __m128i mask = _mm_set1_epi32(test.mask);
+    __m128i masked = _mm_and_si128(flags, mask);
+    if (test.all)
+        return _mm_cmpeq_epi32(masked, mask);
+    else
+        return _mm_xor_si128(_mm_cmpeq_epi32(masked, _mm_setzero_si128()), _mm_set1_epi32(-1));
+}
+
+TARGET_SSE2
+static void ClassifyFogLine_Sse2(const uint32_t *flags, unsigned int count, const FogRule &rule, uint8_t *out)
+{
+    const __m128i half_value = _mm_set1_epi32(rule.half_value);
+    const __m128i full_value = _mm_set1_epi32(rule.full_value);
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i tile_flags = _mm_loadu_si128((const __m128i *)(flags + i));
+        __m128i half = FogTestMatches_Sse2(tile_flags, rule.half_test);
+        __m128i zero = FogTestMatches_Sse2(tile_flags, rule.zero_test);
+        __m128i result = _mm_or_si128(_mm_andnot_si128(half, full_value), _mm_and_si128(half, half_value));
+        result = _mm_andnot_si128(zero, result);
+        result = _mm_packs_epi32(result, result);
+        result = _mm_packus_epi16(result, result);
+        *(uint32_t *)(out + i) = _mm_cvtsi128_si32(result);
+    }
+    ClassifyFogLine_Scalar(flags, i, count, rule, out);
+}
+
+void ClassifyFogLine(const uint32_t *flags, unsigned int count, const FogRule &rule, uint8_t *out)
+{
+    if (count >= 4 && Cpu::HasSse2())
+        return ClassifyFogLine_Sse2(flags, count, rule, out);
+    ClassifyFogLine_Scalar(flags, 0, count, rule, out);
+}
+
+static void BlurFog_Scalar(const uint8_t *in, uint8_t *out, int width, int height)
+{
+    for (int y = 1; y < height - 1; y++)
+    {
+        const uint8_t *pos = in + y * width + 1;
+        uint8_t *out_pos = out + y * width + 1;
+        for (int x = 1; x < width - 1; x++)
+        {
+            int val = pos[0] * 2;
+            val = (val + pos[-1] + pos[1] + pos[-width] + pos[width]) * 2;
+            val = (val + pos[-width - 1] + pos[-width + 1] + pos[width - 1] + pos[width + 1]) / 16;
+            *out_pos = val;
+            pos++;
+            out_pos++;
+        }
+    }
+}
+
+// Weights the 3 tiles centered at each of the 16 positions as 1, 2, 1, giving 16-bit sums.
+// The blur is then 2 * sums of the center row + sums of the rows above and below.
+TARGET_SSE2
+static inline void BlurRowSums_Sse2(const uint8_t *pos, __m128i *sums)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i left = _mm_loadu_si128((const __m128i *)(pos - 1));
+    __m128i mid = _mm_loadu_si128((const __m128i *)pos);
+    __m128i right = _mm_loadu_si128((const __m128i *)(pos + 1));
+    sums[0] = _mm_add_epi16(_mm_unpacklo_epi8(left, zero), _mm_unpacklo_epi8(right, zero));
+    sums[0] = _mm_add_epi16(sums[0], _mm_slli_epi16(_mm_unpacklo_epi8(mid, zero), 1));
+    sums[1] = _mm_add_epi16(_mm_unpackhi_epi8(left, zero), _mm_unpackhi_epi8(right, zero));
+    sums[1] = _mm_add_epi16(sums[1], _mm_slli_epi16(_mm_unpackhi_epi8(mid, zero), 1));
+}
+
+// Does 16 tiles at time, with the last block of a row overlapping the previous one
+TARGET_SSE2
+static void BlurFog_Sse2(const uint8_t *in, uint8_t *out, int width, int height)
+{
+    for (int y = 1; y < height - 1; y++)
+    {
+        for (int x = 1; x < width - 1; x += 16)
+        {
+            if (x > width - 17)
+                x = width - 17;
+            const uint8_t *pos = in + y * width + x;
+            __m128i above[2], center[2], below[2];
+            BlurRowSums_Sse2(pos - width, above);
+            BlurRowSums_Sse2(pos, center);
+            BlurRowSums_Sse2(pos + width, below);
+            __m128i result[2];
+            for (int i = 0; i < 2; i++)
+            {
+                __m128i val = _mm_add_epi16(_mm_slli_epi16(center[i], 1), _mm_add_epi16(above[i], below[i]));
+                result[i] = _mm_srli_epi16(val, 4);
+            }
+            _mm_storeu_si128((__m128i *)(out + y * width + x), _mm_packus_epi16(result[0], result[1]));
+            if (x == width - 17)
+                break;
+        }
+    }
+}
+
+void BlurFog(const uint8_t *in, uint8_t *out, int width, int height)
+{
+    if (width >= 18 && Cpu::HasSse2())
+        return BlurFog_Sse2(in, out, width, height);
+    BlurFog_Scalar(in, out, width, height);
+}
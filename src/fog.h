@@ -0,0 +1,54 @@
+#ifndef FOG_H
+#define FOG_H
+
+#include "types.h"
+#include "resolution.h"
+
+// The fog arrays cover the game screen and a border of 2 tiles around it, which the blur
+// reads from. Bw allocates them itself for 640x480, so they can only be as large as that.
+const int fog_width = resolution::game_width / 32 + 4;
+const int fog_height = resolution::game_height_tiles + 4;
+static_assert(fog_width == 0x18 && fog_height == 0x11, "Bw's fog arrays are for 640x480");
+
+// Tells whether a tile's map_tile_flags match mask: with all, every bit of mask has to be set,
+// otherwise any of them.
+struct FogTest
+{
+    uint32_t mask;
+    bool all;
+
+    bool Matches(uint32_t flags) const { return all ? (flags & mask) == mask : (flags & mask) != 0; }
+    bool operator==(const FogTest &other) const { return mask == other.mask && all == other.all; }
+};
+
+// How GenerateFog converts tile flags to fog values: Tiles matching zero_test become 0,
+// tiles matching half_test become half_value, and rest become full_value.
+struct FogRule
+{
+    FogTest zero_test;
+    FogTest half_test;
+    uint8_t half_value;
+    uint8_t full_value;
+
+    uint8_t Value(uint32_t flags) const
+    {
+        if (zero_test.Matches(flags))
+            return 0;
+        if (half_test.Matches(flags))
+            return half_value;
+        return full_value;
+    }
+    bool operator==(const FogRule &other) const
+    {
+        return zero_test == other.zero_test && half_test == other.half_test &&
+            half_value == other.half_value && full_value == other.full_value;
+    }
+};
+
+// Vectorized parts of GenerateFog, picking the version the cpu supports.
+// Writes rule.Value(flags[i]) to out[i] for each i in [0, count).
+void ClassifyFogLine(const uint32_t *flags, unsigned int count, const FogRule &rule, uint8_t *out);
+// Blurs the width x height array in with a 3x3 kernel, writing everything except the outermost tiles of out.
+void BlurFog(const uint8_t *in, uint8_t *out, int width, int height);
+
+#endif // FOG_H
@@ -0,0 +1,96 @@
+#include "frame_graph.h"
+
+#include <algorithm>
+
+#include "scthread.h"
+#include "console/assert.h"
+
+bool parallel_frame_phases = false;
+
+void FrameGraph::AddPhase(const char *name, uint32_t reads, uint32_t writes, void (*func)())
+{
+    phases.push_back({ name, reads | writes, writes, func });
+    schedule_built = false;
+}
+
+bool FrameGraph::Conflicts(const Phase &a, const Phase &b)
+{
+    return (a.writes & b.reads) != 0 || (b.writes & a.reads) != 0;
+}
+
+void FrameGraph::BuildSchedule()
+{
+    vector<int> phase_steps;
+    int step_count = 0;
+    for (unsigned i = 0; i < phases.size(); i++)
+    {
+        int step = 0;
+        for (unsigned j = 0; j < i; j++)
+        {
+            if (Conflicts(phases[i], phases[j]))
+                step = std::max(step, phase_steps[j] + 1);
+        }
+        phase_steps.emplace_back(step);
+        step_count = std::max(step_count, step + 1);
+    }
+    step_order.clear();
+    step_ends.clear();
+    for (int step = 0; step < step_count; step++)
+    {
+        for (unsigned i = 0; i < phases.size(); i++)
+        {
+            if (phase_steps[i] == step)
+                step_order.emplace_back(i);
+        }
+        step_ends.emplace_back(step_order.size());
+    }
+    if (Debug)
+    {
+        // Conflicting phases must never share a step, and must keep their serial order
+        for (unsigned i = 0; i < phases.size(); i++)
+        {
+            for (unsigned j = 0; j < i; j++)
+            {
+                if (Conflicts(phases[i], phases[j]))
+                    Assert(phase_steps[j] < phase_steps[i]);
+            }
+        }
+    }
+    schedule_built = true;
+}
+
+int FrameGraph::StepCount()
+{
+    if (!schedule_built)
+        BuildSchedule();
+    return step_ends.size();
+}
+
+void FrameGraph::Run(bool parallel)
+{
+    if (!parallel)
+    {
+        for (auto &phase : phases)
+            phase.func();
+        return;
+    }
+
+    if (!schedule_built)
+        BuildSchedule();
+    int step_begin = 0;
+    for (int step_end : step_ends)
+    {
+        if (step_end - step_begin == 1)
+        {
+            phases[step_order[step_begin]].func();
+        }
+        else
+        {
+            ParallelFor(step_begin, step_end, 1, [this](ScThreadVars *, uint32_t begin, uint32_t end) {
+                for (uint32_t i = begin; i < end; i++)
+                    phases[step_order[i]].func();
+            });
+        }
+        step_begin = step_end;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef FRAME_GRAPH_H
+#define FRAME_GRAPH_H
+
+#include "types.h"
+
+// Global state which frame phases declare to read or write.
+// Declarations have to be conservative: if a phase may touch something, it has to be declared,
+// as phases which do not conflict can be executed simultaneously.
+namespace FrameState
+{
+    const uint32_t Rng = 0x1;
+    const uint32_t Units = 0x2;
+    const uint32_t Bullets = 0x4;
+    const uint32_t Flingies = 0x8;
+    // Sprites, images and the sprite draw lists
+    const uint32_t Sprites = 0x10;
+    // map_tile_flags and creep
+    const uint32_t MapTiles = 0x20;
+    const uint32_t Ai = 0x40;
+    // vision_update_count and vision_updated
+    const uint32_t VisionTimer = 0x80;
+    const uint32_t Everything = 0xffffffff;
+}
+
+// Runs a fixed list of phases in steps: a phase is placed in the step right after
+// the last earlier phase it conflicts with. Two phases conflict if either one writes
+// something the other one reads or writes, so every conflicting pair keeps the
+// order they were added in, and the result is identical to running them serially.
+class FrameGraph
+{
+    public:
+        FrameGraph() : schedule_built(false) {}
+
+        void AddPhase(const char *name, uint32_t reads, uint32_t writes, void (*func)());
+
+        // If parallel is false, the phases are just ran in the order they were added.
+        // Otherwise phases of a step are split between the calling thread and the worker pool.
+        void Run(bool parallel);
+
+        int StepCount();
+
+    private:
+        struct Phase
+        {
+            const char *name;
+            uint32_t reads;
+            uint32_t writes;
+            void (*func)();
+        };
+
+        static bool Conflicts(const Phase &a, const Phase &b);
+        void BuildSchedule();
+
+        vector<Phase> phases;
+        // Phase indices, a step ends at each entry of step_ends
+        vector<int> step_order;
+        vector<int> step_ends;
+        bool schedule_built;
+};
+
+// Enabling makes ProgressObjects run nonconflicting phases on the worker pool.
+// Disabled by default, as currently only trivial phases can overlap and it is not worth
+// the dispatch, and it would also run some bw functions on worker threads.
+extern bool parallel_frame_phases;
+
+#endif // FRAME_GRAPH_H
@@ -19,6 +19,9 @@
 #include "commands.h"
 #include "dialog.h"
 #include "test_game.h"
+#include "frame_graph.h"
+#include "slab_allocator.h"
+#include "draw.h"
 
 #include "console/windows_wrap.h"
 
@@ -90,7 +93,7 @@ static void LogSync(const SyncHashes *hashes)
     DumpUnits();
 }
 
-static SyncHashes GetSyncHashes()
+SyncHashes GetSyncHashes()
 {
     uint32_t units_hash = 0, bullets_hash = 0, paths_hash = 0, ai_region_hash = 0, ai_hash = 0;
     uint32_t unit_sprites_hash = 0, bullet_sprites_hash = 0, trigger_hash = 0;
@@ -176,45 +179,83 @@ static SyncHashes GetSyncHashes()
     return SyncHashes(main_hash, units_hash, bullets_hash, unit_sprites_hash, bullet_sprites_hash, paths_hash, ai_region_hash, ai_hash, trigger_hash);
 }
 
-void ProgressObjects()
+static void UpdateVisionTimer()
 {
-    PerfClock clock;
-    perf_log->Indent(2);
-
-    EnableRng(true);
-    TryUpdateCreepDisappear();
-    ProgressAi();
-
     if (*bw::vision_update_count == 0)
         *bw::vision_update_count = 100;
 
     *bw::vision_updated = *bw::vision_update_count == 1;
     *bw::vision_update_count -= 1;
+}
+
+static void ProgressVisionCreep()
+{
     if (*bw::vision_updated)
-    {
         ProgressCreepDisappearance();
+}
+
+static void ProgressVisionFog()
+{
+    if (*bw::vision_updated)
         UpdateFog();
-    }
+}
 
-    auto pre_time = clock.GetTime();
-    auto total_time = pre_time;
+static void ProgressUnitsAndBullets()
+{
     unitframes_in_progress = true;
     auto unit_results = Unit::ProgressFrames();
     unitframes_in_progress = false;
-    auto unit_time = clock.GetTime() - total_time;
-    total_time += unit_time;
     BulletFramesInput bullet_input(move(unit_results.weapon_damages), move(unit_results.hallucination_hits),
             move(unit_results.ai_hit_reactions));
     bullet_system->ProgressFrames(move(bullet_input));
-    auto bullet_time = clock.GetTime() - total_time;
-    total_time += bullet_time;
+}
+
+static void ProgressFlingies()
+{
     Flingy::ProgressFrames();
+}
+
+static void ProgressLoneSprites()
+{
     lone_sprites->ProgressFrames();
+}
 
+static FrameGraph *CreateObjectFrameGraph()
+{
+    FrameGraph *graph = new FrameGraph;
+    // Mostly bw functions, so the declarations are rather pessimistic
+    graph->AddPhase("Creep disappear timer", 0, FrameState::MapTiles | FrameState::Rng,
+            &TryUpdateCreepDisappear);
+    graph->AddPhase("Ai", FrameState::Units | FrameState::Bullets | FrameState::Sprites | FrameState::MapTiles,
+            FrameState::Ai | FrameState::Units | FrameState::Rng, &ProgressAi);
+    graph->AddPhase("Vision timer", 0, FrameState::VisionTimer, &UpdateVisionTimer);
+    graph->AddPhase("Creep disappearance", FrameState::VisionTimer | FrameState::Units,
+            FrameState::MapTiles | FrameState::Sprites | FrameState::Rng, &ProgressVisionCreep);
+    graph->AddPhase("Fog", FrameState::VisionTimer | FrameState::Units | FrameState::Sprites,
+            FrameState::MapTiles, &ProgressVisionFog);
+    graph->AddPhase("Units and bullets", FrameState::Everything, FrameState::Everything,
+            &ProgressUnitsAndBullets);
+    graph->AddPhase("Flingies", FrameState::Units | FrameState::MapTiles,
+            FrameState::Flingies | FrameState::Sprites | FrameState::Rng, &ProgressFlingies);
+    graph->AddPhase("Lone sprites", FrameState::MapTiles, FrameState::Sprites | FrameState::Rng,
+            &ProgressLoneSprites);
+    return graph;
+}
+
+void ProgressObjects()
+{
+    static FrameGraph *frame_graph = CreateObjectFrameGraph();
+    PerfClock clock;
+    perf_log->Indent(2);
+
+    EnableRng(true);
+    frame_graph->Run(parallel_frame_phases);
     EnableRng(false);
-    auto rest_time = clock.GetTime() - total_time;
+
     perf_log->Indent(-2);
-    perf_log->Log("ProgressObjects: Pre %f ms + rest %f ms (+ units + bullets) = about %f ms\n", pre_time, rest_time, clock.GetTime());
+    perf_log->Log("ProgressObjects: %d steps (%s), about %f ms\n", frame_graph->StepCount(),
+            parallel_frame_phases ? "parallel" : "serial", clock.GetTime());
+    SlabAllocator::LogStats();
 }
 
 inline void SetFrameState(int state)
@@ -350,6 +391,7 @@ static void FreeAllObjects()
 void GameEnd()
 {
     FreeAllObjects();
+    ClearGeneratedFog();
     if (*bw::is_ingame2)
     {
         *bw::leave_game_tick = GetTickCount();
@@ -3,10 +3,14 @@
 
 #include "types.h"
 
+struct SyncHashes;
+
 int ProgressFrames();
 void ProgressObjects();
 void GameEnd();
 void BriefingOk(Dialog *dlg, bool leave);
+// Hashes of the game state after the last frame (see sync.h)
+SyncHashes GetSyncHashes();
 
 struct DoWeaponDamageData
 {
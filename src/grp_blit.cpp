@@ -0,0 +1,217 @@
+#include "grp_blit.h"
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "cpu.h"
+
+GrpRemap::GrpRemap(const uint8_t *table) : table(table), changed_count(0)
+{
+    for (int i = 1; i < 0x100; i++)
+    {
+        if (table[i] != i)
+        {
+            if (changed_count < MaxChanged)
+            {
+                changed_index[changed_count] = i;
+                changed_color[changed_count] = table[i];
+            }
+            changed_count++;
+        }
+    }
+}
+
+template <bool flipped>
+static void BlitGrpLine_Scalar(const uint8_t *in, uint8_t *out, int width, const GrpRemap *remap)
+{
+    const uint8_t *table = remap->table;
+    for (int i = 0; i < width; i++)
+    {
+        uint8_t color = flipped ? in[-i] : in[i];
+        if (color)
+            out[i] = table[color];
+    }
+}
+
+TARGET_SSE2
+static inline __m128i Blend_Sse2(__m128i a, __m128i b, __m128i mask)
+{
+    return _mm_or_si128(_mm_andnot_si128(mask, a), _mm_and_si128(mask, b));
+}
+
+TARGET_SSE2
+static inline __m128i Reverse_Sse2(__m128i val)
+{
+    val = _mm_shuffle_epi32(val, _MM_SHUFFLE(0, 1, 2, 3));
+    val = _mm_shufflelo_epi16(val, _MM_SHUFFLE(2, 3, 0, 1));
+    val = _mm_shufflehi_epi16(val, _MM_SHUFFLE(2, 3, 0, 1));
+    return _mm_or_si128(_mm_slli_epi16(val, 8), _mm_srli_epi16(val, 8));
+}
+
+template <bool flipped>
+TARGET_SSE2
+static void BlitGrpLine_Sse2(const uint8_t *in, uint8_t *out, int width, const GrpRemap *remap)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < width; i += 16)
+    {
+        __m128i colors;
+        if (flipped)
+            colors = Reverse_Sse2(_mm_loadu_si128((const __m128i *)(in - i - 15)));
+        else
+            colors = _mm_loadu_si128((const __m128i *)(in + i));
+        __m128i result = colors;
+        for (int j = 0; j < remap->changed_count; j++)
+        {
+            __m128i match = _mm_cmpeq_epi8(colors, _mm_set1_epi8(remap->changed_index[j]));
+            result = Blend_Sse2(result, _mm_set1_epi8(remap->changed_color[j]), match);
+        }
+        __m128i transparent = _mm_cmpeq_epi8(colors, zero);
+        __m128i prev = _mm_loadu_si128((const __m128i *)(out + i));
+        _mm_storeu_si128((__m128i *)(out + i), Blend_Sse2(result, prev, transparent));
+    }
+}
+
+template <bool flipped>
+TARGET_AVX2
+static void BlitGrpLine_Avx2(const uint8_t *in, uint8_t *out, int width, const GrpRemap *remap)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i reverse = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+            15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    int i = 0;
+    for (; i + 32 <= width; i += 32)
+    {
+        __m256i colors;
+        if (flipped)
+        {
+            colors = _mm256_loadu_si256((const __m256i *)(in - i - 31));
+            colors = _mm256_shuffle_epi8(colors, reverse);
+            colors = _mm256_permute2x128_si256(colors, colors, 0x01);
+        }
+        else
+            colors = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i result = colors;
+        for (int j = 0; j < remap->changed_count; j++)
+        {
+            __m256i match = _mm256_cmpeq_epi8(colors, _mm256_set1_epi8(remap->changed_index[j]));
+            result = _mm256_blendv_epi8(result, _mm256_set1_epi8(remap->changed_color[j]), match);
+        }
+        __m256i transparent = _mm256_cmpeq_epi8(colors, zero);
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(out + i));
+        _mm256_storeu_si256((__m256i *)(out + i), _mm256_blendv_epi8(result, prev, transparent));
+    }
+    // Width is only a multiple of 16
+    if (i != width)
+        BlitGrpLine_Sse2<flipped>(flipped ? in - i : in + i, out + i, width - i, remap);
+}
+
+template <bool flipped>
+static void BlitGrpBlendLine_Scalar(const uint8_t *in, uint8_t *out, int width, const uint8_t *blend_table)
+{
+    for (int i = 0; i < width; i++)
+    {
+        uint8_t color = flipped ? in[-i] : in[i];
+        out[i] = blend_table[color << 8 | out[i]];
+    }
+}
+
+// Only checks quickly for transparent runs, the lookups are done one pixel at time
+template <bool flipped>
+TARGET_SSE2
+static void BlitGrpBlendLine_Sse2(const uint8_t *in, uint8_t *out, int width, const uint8_t *blend_table)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < width; i += 16)
+    {
+        __m128i colors;
+        if (flipped)
+            colors = _mm_loadu_si128((const __m128i *)(in - i - 15));
+        else
+            colors = _mm_loadu_si128((const __m128i *)(in + i));
+        uint32_t transparent = _mm_movemask_epi8(_mm_cmpeq_epi8(colors, zero));
+        if (transparent == 0xffff)
+            continue;
+        for (int j = 0; j < 16; j++)
+        {
+            uint8_t color = flipped ? in[-i - j] : in[i + j];
+            if (color)
+                out[i + j] = blend_table[color << 8 | out[i + j]];
+        }
+    }
+}
+
+// Gathers 8 blended pixels, pixels with grp color 0 are not read and keep surface color.
+// The gather reads 4 bytes ending at the wanted one, so it never reads past the 64 KB table,
+// and as grp color is nonzero, does not read before it either.
+TARGET_AVX2
+static inline __m256i GatherBlend_Avx2(const uint8_t *blend_table, __m128i colors, __m128i surface)
+{
+    __m256i in = _mm256_cvtepu8_epi32(colors);
+    __m256i out = _mm256_cvtepu8_epi32(surface);
+    __m256i index = _mm256_sub_epi32(_mm256_or_si256(_mm256_slli_epi32(in, 8), out), _mm256_set1_epi32(3));
+    __m256i opaque = _mm256_xor_si256(_mm256_cmpeq_epi32(in, _mm256_setzero_si256()), _mm256_set1_epi32(-1));
+    __m256i result = _mm256_mask_i32gather_epi32(_mm256_slli_epi32(out, 24), (const int *)blend_table,
+            index, opaque, 1);
+    return _mm256_srli_epi32(result, 24);
+}
+
+template <bool flipped>
+TARGET_AVX2
+static void BlitGrpBlendLine_Avx2(const uint8_t *in, uint8_t *out, int width, const uint8_t *blend_table)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i reverse = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    for (int i = 0; i < width; i += 16)
+    {
+        __m128i colors;
+        if (flipped)
+            colors = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in - i - 15)), reverse);
+        else
+            colors = _mm_loadu_si128((const __m128i *)(in + i));
+        uint32_t transparent = _mm_movemask_epi8(_mm_cmpeq_epi8(colors, zero));
+        if (transparent == 0xffff)
+            continue;
+        __m128i surface = _mm_loadu_si128((const __m128i *)(out + i));
+        __m256i low = GatherBlend_Avx2(blend_table, colors, surface);
+        __m256i high = GatherBlend_Avx2(blend_table, _mm_srli_si128(colors, 8), _mm_srli_si128(surface, 8));
+        // Packing works inside 128-bit lanes, so the 16-bit values have to be reordered before packing to bytes
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(low, high), _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+        _mm_storeu_si128((__m128i *)(out + i), bytes);
+    }
+}
+
+static bool KeepsTransparentPixels(const uint8_t *blend_table)
+{
+    for (int i = 0; i < 0x100; i++)
+    {
+        if (blend_table[i] != i)
+            return false;
+    }
+    return true;
+}
+
+GrpBlendLineBlitter GetGrpBlendLineBlitter(bool flipped, const uint8_t *blend_table)
+{
+    if (KeepsTransparentPixels(blend_table))
+    {
+        if (Cpu::HasAvx2())
+            return flipped ? &BlitGrpBlendLine_Avx2<true> : &BlitGrpBlendLine_Avx2<false>;
+        if (Cpu::HasSse2())
+            return flipped ? &BlitGrpBlendLine_Sse2<true> : &BlitGrpBlendLine_Sse2<false>;
+    }
+    return flipped ? &BlitGrpBlendLine_Scalar<true> : &BlitGrpBlendLine_Scalar<false>;
+}
+
+GrpLineBlitter GetGrpLineBlitter(bool flipped, const GrpRemap &remap)
+{
+    if (remap.changed_count <= GrpRemap::MaxChanged)
+    {
+        if (Cpu::HasAvx2())
+            return flipped ? &BlitGrpLine_Avx2<true> : &BlitGrpLine_Avx2<false>;
+        if (Cpu::HasSse2())
+            return flipped ? &BlitGrpLine_Sse2<true> : &BlitGrpLine_Sse2<false>;
+    }
+    return flipped ? &BlitGrpLine_Scalar<true> : &BlitGrpLine_Scalar<false>;
+}
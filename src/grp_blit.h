@@ -0,0 +1,40 @@
+#ifndef GRP_BLIT_H
+#define GRP_BLIT_H
+
+#include "types.h"
+
+// Remap table of a grp draw call, with the colors it changes collected, so the
+// vectorized blitters can apply them with compares instead of table lookups.
+// Bw's default remap only changes the player colors.
+class GrpRemap
+{
+    public:
+        static const int MaxChanged = 16;
+
+        GrpRemap(const uint8_t *table);
+
+        const uint8_t *table;
+        // Color 0 is never included, as it is transparent.
+        // If changed_count is above MaxChanged, only the table can be used.
+        int changed_count;
+        uint8_t changed_index[MaxChanged];
+        uint8_t changed_color[MaxChanged];
+};
+
+// Draws width pixels of a decoded grp line through remap, leaving pixels which are 0 in the grp
+// untouched. Width has to be a multiple of grp_padding_size. If flipped, in points to the first
+// pixel to be drawn and the line is read backwards.
+typedef void (*GrpLineBlitter)(const uint8_t *in, uint8_t *out, int width, const GrpRemap *remap);
+
+// Picks the vectorized version the cpu supports, if remap allows it
+GrpLineBlitter GetGrpLineBlitter(bool flipped, const GrpRemap &remap);
+
+// Draws width pixels of a decoded grp line as blend_table[grp_color << 8 | surface_color].
+// Width and flipping are same as with GrpLineBlitter.
+typedef void (*GrpBlendLineBlitter)(const uint8_t *in, uint8_t *out, int width, const uint8_t *blend_table);
+
+// The vectorized versions skip runs of grp color 0 and only look up the other pixels,
+// so they are used only if blend_table does not change pixels with grp color 0.
+GrpBlendLineBlitter GetGrpBlendLineBlitter(bool flipped, const uint8_t *blend_table);
+
+#endif // GRP_BLIT_H
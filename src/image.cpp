@@ -10,7 +10,9 @@
 #include "unit.h"
 #include "yms.h"
 #include "draw.h"
+#include "grp_blit.h"
 #include "perfclock.h"
+#include "slab_allocator.h"
 #include "strings.h"
 
 #include <atomic>
@@ -28,8 +30,8 @@ int GrpFrameHeader::GetWidth() const
         // Round upwards to grp_padding_size
         width += (grp_padding_size - 1);
         width &= ~(grp_padding_size - 1);
-        // And add safety padding
-        width += 2 * (grp_padding_size - 1);
+        // And add safety padding, which is shared by the left and right sides of lines
+        width += grp_padding_size - 1;
         return width;
     }
     else
@@ -127,15 +129,20 @@ bool Image::InitIscript(Iscript::Context *ctx)
     return true;
 }
 
-#ifdef SYNC
+static SlabAllocator image_allocator("Image", sizeof(Image));
+
 void *Image::operator new(size_t size)
 {
-    auto ret = new uint8_t[size];
+    auto ret = image_allocator.Allocate(size);
     if (SyncTest)
         ScrambleStruct(ret, size);
     return ret;
 }
-#endif
+
+void Image::operator delete(void *ptr)
+{
+    image_allocator.Free(ptr);
+}
 
 void Image::SingleDelete()
 {
@@ -651,10 +658,10 @@ std::string Image::DebugStr() const
     return buf;
 }
 
-// Could only have one padding between lines,
-// it can work as both left/right padding
-template <class Operation>
-void Render_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Operation op)
+// Lines have only one padding between them, which works as both left/right padding
+// Calls op(image_pos, surface_pos, draw_width) for each line, draw_width is a multiple of grp_padding_size
+template <class LineOperation>
+void RenderLines_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, LineOperation op)
 {
     const int loop_unroll_count = grp_padding_size;
 
@@ -662,10 +669,8 @@ void Render_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect,
     uint8_t *surface_pos = surface->image + x + y * surface->w;
     x32 skip = rect->left;
     x32 draw_width = ((rect->right + (loop_unroll_count - 1)) & ~(loop_unroll_count - 1));
-    int surface_add = surface->w - draw_width;
     uint8_t *img = frame_header->frame;
     int img_width = frame_header->GetWidth();
-    int img_add = img_width - draw_width;
     uint8_t *image_pos = img + 2 + img_width * rect->top + loop_unroll_count - 1; // + 2 is for the two zeroes signifying decoded img
     image_pos += skip;
     if (x + draw_width >= surface->w)
@@ -676,29 +681,15 @@ void Render_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect,
     }
     for (y32 line_count = rect->bottom; line_count != 0; line_count--)
     {
-        for (x32 x = 0; x < draw_width; x += loop_unroll_count)
-        {
-            // Clang seems only unroll up to 8 iterations, which might be better
-            for (int i = 0; i < loop_unroll_count / 2; i++)
-            {
-                op(image_pos, surface_pos);
-                image_pos++;
-                surface_pos++;
-            }
-            for (int i = 0; i < loop_unroll_count / 2; i++)
-            {
-                op(image_pos, surface_pos);
-                image_pos++;
-                surface_pos++;
-            }
-        }
-        image_pos += img_add;
-        surface_pos += surface_add;
+        op(image_pos, surface_pos, (int)draw_width);
+        image_pos += img_width;
+        surface_pos += surface->w;
     }
 }
 
-template <class Operation>
-void Render_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Operation op)
+// Image_pos points to the first pixel drawn, and moves backwards
+template <class LineOperation>
+void RenderLines_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, LineOperation op)
 {
     const int loop_unroll_count = grp_padding_size;
 
@@ -706,10 +697,8 @@ void Render_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Op
     x32 skip = rect->left;
     x32 draw_width = ((rect->right + (loop_unroll_count - 1)) & ~(loop_unroll_count - 1));
     uint8_t *surface_pos = surface->image + x + y * surface->w;
-    int surface_add = surface->w - draw_width;
     uint8_t *img = frame_header->frame;
     int img_width = frame_header->GetWidth();
-    int img_add = img_width + draw_width;
     uint8_t *image_pos = img + 2 + img_width * rect->top + loop_unroll_count - 1 + frame_header->w - 1; // + 2 is for the two zeroes signifying decoded img
     image_pos -= skip;
     if (x + draw_width >= surface->w)
@@ -720,7 +709,42 @@ void Render_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Op
     }
     for (y32 line_count = rect->bottom; line_count != 0; line_count--)
     {
-        for (x32 x = 0; x < draw_width; x += loop_unroll_count)
+        op(image_pos, surface_pos, (int)draw_width);
+        image_pos += img_width;
+        surface_pos += surface->w;
+    }
+}
+
+template <class Operation>
+void Render_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Operation op)
+{
+    const int loop_unroll_count = grp_padding_size;
+    RenderLines_NonFlipped(x, y, frame_header, rect, [&](uint8_t *image_pos, uint8_t *surface_pos, int draw_width) {
+        for (int x = 0; x < draw_width; x += loop_unroll_count)
+        {
+            // Clang seems only unroll up to 8 iterations, which might be better
+            for (int i = 0; i < loop_unroll_count / 2; i++)
+            {
+                op(image_pos, surface_pos);
+                image_pos++;
+                surface_pos++;
+            }
+            for (int i = 0; i < loop_unroll_count / 2; i++)
+            {
+                op(image_pos, surface_pos);
+                image_pos++;
+                surface_pos++;
+            }
+        }
+    });
+}
+
+template <class Operation>
+void Render_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Operation op)
+{
+    const int loop_unroll_count = grp_padding_size;
+    RenderLines_Flipped(x, y, frame_header, rect, [&](uint8_t *image_pos, uint8_t *surface_pos, int draw_width) {
+        for (int x = 0; x < draw_width; x += loop_unroll_count)
         {
             for (int i = 0; i < loop_unroll_count / 2; i++)
             {
@@ -735,42 +759,46 @@ void Render_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, Op
                 surface_pos++;
             }
         }
-        image_pos += img_add;
-        surface_pos += surface_add;
-    }
+    });
 }
 
 void __fastcall DrawBlended_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, void *param)
 {
+    STATIC_PERF_CLOCK(DrawBlended);
     uint8_t *blend_table = (uint8_t *)param;
-    Render_NonFlipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out) {
-        *out = blend_table[*in << 8 | *out];
+    GrpBlendLineBlitter blit = GetGrpBlendLineBlitter(false, blend_table);
+    RenderLines_NonFlipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out, int width) {
+        blit(in, out, width, blend_table);
     });
 }
 
 void __fastcall DrawBlended_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, void *param)
 {
+    STATIC_PERF_CLOCK(DrawBlended);
     uint8_t *blend_table = (uint8_t *)param;
-    Render_Flipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out) {
-        *out = blend_table[*in << 8 | *out];
+    GrpBlendLineBlitter blit = GetGrpBlendLineBlitter(true, blend_table);
+    RenderLines_Flipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out, int width) {
+        blit(in, out, width, blend_table);
     });
 }
 
 void __fastcall DrawNormal_NonFlipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, void *unused)
 {
     STATIC_PERF_CLOCK(Dn2);
-    uint8_t *remap = (uint8_t *)bw::default_grp_remap.raw_pointer();
-    Render_NonFlipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out) {
-        *out = *in ? remap[*in] : *out;
+    GrpRemap remap((uint8_t *)bw::default_grp_remap.raw_pointer());
+    GrpLineBlitter blit = GetGrpLineBlitter(false, remap);
+    RenderLines_NonFlipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out, int width) {
+        blit(in, out, width, &remap);
     });
 }
 
 void __fastcall DrawNormal_Flipped(int x, int y, GrpFrameHeader *frame_header, Rect32 *rect, void *unused)
 {
     STATIC_PERF_CLOCK(Dn2);
-    uint8_t *remap = (uint8_t *)bw::default_grp_remap.raw_pointer();
-    Render_Flipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out) {
-        *out = *in ? remap[*in] : *out;
+    GrpRemap remap((uint8_t *)bw::default_grp_remap.raw_pointer());
+    GrpLineBlitter blit = GetGrpLineBlitter(true, remap);
+    RenderLines_Flipped(x, y, frame_header, rect, [&](uint8_t *in, uint8_t *out, int width) {
+        blit(in, out, width, &remap);
     });
 }
 
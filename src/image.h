@@ -121,9 +121,8 @@ class Image
 
         // ---------------
 
-#ifdef SYNC
         void *operator new(size_t size);
-#endif
+        void operator delete(void *ptr);
         /// Does no real initialization. Useful when bw is going to initialize it
         Image();
         /// Initializes the image, but does not add it to parent's list.
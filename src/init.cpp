@@ -11,6 +11,31 @@
 #include "player.h"
 #include "limits.h"
 #include "warn.h"
+#include "scthread.h"
+#include "perfclock.h"
+#include "log.h"
+
+#include <atomic>
+#include <string>
+
+// Lines share the padding between them, as the right padding of a line
+// works as the left padding of next line
+static int DecodedLineWidth(int width, int padding)
+{
+    return ((width + (padding - 1)) & ~(padding - 1)) + (padding - 1);
+}
+
+static int DecodedFrameSize(const GrpFrameHeader *frame, int padding)
+{
+    return 2 + (padding - 1) + DecodedLineWidth(frame->w, padding) * frame->h;
+}
+
+// Offset of the first decoded frame, the rest follow it in order
+static uint32_t FirstDecodedFrameOffset(const void *data)
+{
+    int frame_count = *(const uint16_t *)data;
+    return 6 + frame_count * sizeof(GrpFrameHeader);
+}
 
 static int GetDecodedImageSize(const void *data_, int padding)
 {
@@ -20,22 +45,22 @@ static int GetDecodedImageSize(const void *data_, int padding)
     GrpFrameHeader *frame = (GrpFrameHeader *)(data + 6);
     for (int i = 0; i < frame_count; i++)
     {
-        int padded_w = ((frame->w + (padding - 1)) & ~(padding - 1)) + 2 * (padding - 1);
-        image_size += 2 + padded_w * frame->h;
+        image_size += DecodedFrameSize(frame, padding);
         frame++;
     }
-    return 6 + frame_count * sizeof(GrpFrameHeader) + image_size + 1;
+    return FirstDecodedFrameOffset(data) + image_size + 1;
 }
 
-// The grp gets transparent padding both left and right, to make loop unrolling possible
-static bool DecodeGrp(const void *input_, void *out_, int padding)
+// Writes the frame headers of a decoded grp, and marks every frame as decoded.
+// The frames themselves are written by DecodeGrpFrame.
+static void DecodeGrpHeader(const void *input_, void *out_, int padding)
 {
     uint8_t *out = (uint8_t *)out_;
     const uint8_t *input = (const uint8_t *)input_;
     int frame_count = *(const uint16_t *)input;
     const GrpFrameHeader *in_frames = (const GrpFrameHeader *)(input + 6);
     GrpFrameHeader *out_frames = (GrpFrameHeader *)(out + 6);
-    uint8_t *out_img = out + 6 + frame_count * sizeof(GrpFrameHeader);
+    uint8_t *out_img = out + FirstDecodedFrameOffset(input);
     memcpy(out, input, 6);
     for (int i = 0; i < frame_count; i++)
     {
@@ -44,59 +69,147 @@ static bool DecodeGrp(const void *input_, void *out_, int padding)
         *out_frame = *in_frame;
         // Bw assumes it has not been converted to pointer yet
         out_frame->frame = (uint8_t *)(out_img - out);
-        *out_img++ = 0; // Marks frame as decoded
-        *out_img++ = 0;
-        int padded_w = ((in_frame->w + (padding - 1)) & ~(padding - 1)) + 2 * (padding - 1);
-        uint8_t *frame_end = out_img + padded_w * in_frame->h;
-        uint8_t *line_start = out_img + padding - 1;
-        uint8_t *line_end = line_start + in_frame->w;
-        uint8_t *padded_end = out_img + padded_w;
-        const uint16_t *in_frame_lines = (const uint16_t *)(input + (uintptr_t)in_frame->frame);
-        while (out_img != frame_end)
+        out_img[0] = 0; // Marks frame as decoded
+        out_img[1] = 0;
+        out_img += DecodedFrameSize(in_frame, padding);
+    }
+}
+
+// The grp gets transparent padding both left and right, to make loop unrolling possible.
+// Out_offset is where DecodeGrpHeader placed the frame. The frame headers of out are not read,
+// as bw may have converted them to pointers while the frame is being decoded.
+static bool DecodeGrpFrame(const void *input_, void *out_, int frame, uint32_t out_offset, int padding)
+{
+    uint8_t *out = (uint8_t *)out_;
+    const uint8_t *input = (const uint8_t *)input_;
+    const GrpFrameHeader *in_frame = (const GrpFrameHeader *)(input + 6) + frame;
+    uint8_t *out_img = out + out_offset + 2;
+    int line_width = DecodedLineWidth(in_frame->w, padding);
+    uint8_t *frame_end = out_img + (padding - 1) + line_width * in_frame->h;
+    // Left padding of the first line
+    memset(out_img, 0, padding - 1);
+    out_img += padding - 1;
+    uint8_t *line_end = out_img + in_frame->w;
+    uint8_t *padded_end = out_img + line_width;
+    const uint16_t *in_frame_lines = (const uint16_t *)(input + (uintptr_t)in_frame->frame);
+    while (out_img != frame_end)
+    {
+        const uint8_t *in_grp = (input + (uintptr_t)in_frame->frame + *in_frame_lines++);
+        Assert(out_img < line_end);
+        while (out_img != line_end)
         {
-            while (out_img != line_start)
-                *out_img++ = 0;
-            const uint8_t *in_grp = (input + (uintptr_t)in_frame->frame + *in_frame_lines++);
-            Assert(out_img < line_end);
-            while (out_img != line_end)
+            uint8_t val = *in_grp++;
+            if (val & 0x80)
             {
-                uint8_t val = *in_grp++;
-                if (val & 0x80)
-                {
-                    val &= ~0x80;
-                    if (out_img + val > line_end)
-                        return false;
-                    memset(out_img, 0, val);
-                    out_img += val;
-                }
-                else if (val & 0x40)
-                {
-                    val &= ~0x40;
-                    if (out_img + val > line_end)
-                        return false;
-                    uint8_t color = *in_grp++;
-                    memset(out_img, color, val);
-                    out_img += val;
-                }
-                else
-                {
-                    if (out_img + val > line_end)
-                        return false;
-                    memcpy(out_img, in_grp, val);
-                    out_img += val;
-                    in_grp += val;
-                }
+                val &= ~0x80;
+                if (out_img + val > line_end)
+                    return false;
+                memset(out_img, 0, val);
+                out_img += val;
+            }
+            else if (val & 0x40)
+            {
+                val &= ~0x40;
+                if (out_img + val > line_end)
+                    return false;
+                uint8_t color = *in_grp++;
+                memset(out_img, color, val);
+                out_img += val;
+            }
+            else
+            {
+                if (out_img + val > line_end)
+                    return false;
+                memcpy(out_img, in_grp, val);
+                out_img += val;
+                in_grp += val;
             }
-            while (out_img != padded_end)
-                *out_img++ = 0;
-            line_end += padded_w;
-            line_start += padded_w;
-            padded_end += padded_w;
         }
+        while (out_img != padded_end)
+            *out_img++ = 0;
+        line_end += line_width;
+        padded_end += line_width;
+    }
+    return true;
+}
+
+// Decodes every frame, with the offsets computed from the input header
+static bool DecodeGrpFrames(const void *input, void *out, int padding)
+{
+    int frame_count = *(const uint16_t *)input;
+    const GrpFrameHeader *in_frames = (const GrpFrameHeader *)((const uint8_t *)input + 6);
+    uint32_t out_offset = FirstDecodedFrameOffset(input);
+    for (int i = 0; i < frame_count; i++)
+    {
+        if (!DecodeGrpFrame(input, out, i, out_offset, padding))
+            return false;
+        out_offset += DecodedFrameSize(in_frames + i, padding);
     }
     return true;
 }
 
+static bool DecodeGrp(const void *input, void *out, int padding)
+{
+    DecodeGrpHeader(input, out, padding);
+    return DecodeGrpFrames(input, out, padding);
+}
+
+// While InitImages is loading grps, decoding the frames is done by the thread pool as bw reads
+// the next grps. The headers are written immediately, as bw converts the frame offsets to pointers.
+// InitGame waits for everything to be decoded before any frame can be drawn.
+struct GrpDecodeTask
+{
+    GrpDecodeTask(void *data, void *decoded, const char *filename) : data(data), decoded(decoded),
+        filename(filename), success(true) {}
+
+    void *data;
+    void *decoded;
+    std::string filename;
+    bool success;
+};
+
+static bool defer_grp_decoding = false;
+static uint32_t decoded_grp_bytes = 0;
+static uint32_t rle_grp_bytes = 0;
+static vector<ptr<GrpDecodeTask>> grp_decode_tasks;
+static std::atomic<int> pending_grp_decodes(0);
+
+static void DecodeGrpTask(ScThreadVars *, GrpDecodeTask *task)
+{
+    task->success = DecodeGrpFrames(task->data, task->decoded, grp_padding_size);
+    pending_grp_decodes.fetch_sub(1, std::memory_order_release);
+}
+
+// Writes the header immediately and leaves the frames to the thread pool
+static void StartGrpDecoding(void *data, void *decoded, const char *filename)
+{
+    DecodeGrpHeader(data, decoded, grp_padding_size);
+    grp_decode_tasks.emplace_back(new GrpDecodeTask(data, decoded, filename));
+    pending_grp_decodes.fetch_add(1, std::memory_order_relaxed);
+    threads->AddTask(&DecodeGrpTask, grp_decode_tasks.back().get());
+}
+
+static void FinishGrpDecoding()
+{
+    if (grp_decode_tasks.empty())
+        return;
+    PerfClock clock;
+    while (pending_grp_decodes.load(std::memory_order_acquire) != 0)
+        SwitchToThread();
+    perf_log->Log("Waited %f ms for %d grps to be decoded\n", clock.GetTime(), (int)grp_decode_tasks.size());
+    perf_log->Log("Decoded grps use %d KB, they would be %d KB without decoding\n", decoded_grp_bytes / 1024,
+            rle_grp_bytes / 1024);
+    decoded_grp_bytes = 0;
+    rle_grp_bytes = 0;
+    for (auto &task : grp_decode_tasks)
+    {
+        if (!task->success)
+            FatalError("%s appears to be corrupt. Was it created with RetroGRP?", task->filename.c_str());
+        SMemFree(task->data, __FILE__, __LINE__, 0);
+    }
+    grp_decode_tasks.clear();
+}
+
 static bool IsDecodedDrawFunc(int drawfunc)
 {
     switch (drawfunc)
@@ -150,17 +263,55 @@ void *LoadGrp(int image_id, uint32_t *images_dat_grp, Tbl *images_tbl, GrpSprite
     else
     {
         ReadFile_Overlapped(nullptr, size, data, file);
+        SFileCloseFile(file);
         int image_size = GetDecodedImageSize(data, grp_padding_size);
         void *decoded = SMemAlloc(image_size, __FILE__, __LINE__, 0);
-        bool success = DecodeGrp(data, decoded, grp_padding_size);
-        if (!success)
-            FatalError("%s appears to be corrupt. Was it created with RetroGRP?", filename);
-        SFileCloseFile(file);
-        SMemFree(data, __FILE__, __LINE__, 0);
+        decoded_grp_bytes += image_size;
+        rle_grp_bytes += size;
+        if (!defer_grp_decoding)
+        {
+            bool success = DecodeGrp(data, decoded, grp_padding_size);
+            if (!success)
+                FatalError("%s appears to be corrupt. Was it created with RetroGRP?", filename);
+            SMemFree(data, __FILE__, __LINE__, 0);
+        }
+        else
+        {
+            StartGrpDecoding(data, decoded, filename);
+        }
         return decoded;
     }
 }
 
+bool TestDeferredGrpDecoding(const char *filename)
+{
+    uint32_t size;
+    void *data = ReadMpqFile(filename, 0, 0, __FILE__, __LINE__, 0, &size);
+    if (data == nullptr)
+        return false;
+    int image_size = GetDecodedImageSize(data, grp_padding_size);
+    vector<uint8_t> expected, decoded;
+    expected.resize(image_size);
+    decoded.resize(image_size);
+    if (!DecodeGrp(data, expected.data(), grp_padding_size))
+    {
+        SMemFree(data, __FILE__, __LINE__, 0);
+        return false;
+    }
+
+    StartGrpDecoding(data, decoded.data(), filename);
+    // Do what bw does to the header after LoadGrp returns, while the frames are being decoded
+    uint8_t *base = decoded.data();
+    int frame_count = *(uint16_t *)base;
+    GrpFrameHeader *frames = (GrpFrameHeader *)(base + 6);
+    for (int i = 0; i < frame_count; i++)
+        frames[i].frame = base + (uintptr_t)frames[i].frame;
+    FinishGrpDecoding();
+    for (int i = 0; i < frame_count; i++)
+        frames[i].frame = (uint8_t *)(frames[i].frame - base);
+    return decoded == expected;
+}
+
 void LoadBlendPalettes(const char *tileset)
 {
     for (int i = 0; i < 7; i++)
@@ -259,7 +410,10 @@ int InitGame()
     InitText();
     InitAi();
     InitTerrain();
+    defer_grp_decoding = true;
     InitImages();
+    defer_grp_decoding = false;
+    FinishGrpDecoding();
     InitSprites();
     InitCursorMarker();
     InitFlingies();
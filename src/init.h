@@ -5,6 +5,9 @@
 
 void *LoadGrp(int image_id, uint32_t *images_dat_grp, Tbl *images_tbl, GrpSprite **loaded_grps, void **overlapped, void **out_file);
 void LoadBlendPalettes(const char *tileset_name);
+/// For testing. Decodes the grp both synchronously and with the thread pool, modifying the
+/// header like bw does during the deferred decoding, and returns whether the results are same.
+bool TestDeferredGrpDecoding(const char *filename);
 
 void InitLoneSprites();
 int InitGame();
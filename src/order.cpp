@@ -1,9 +1,22 @@
 #include "order.h"
 #include "unit.h"
 #include "offsets.h"
+#include "slab_allocator.h"
 
 DummyListHead<Order, Order::offset_of_allocated> first_allocated_order;
 
+static SlabAllocator order_allocator("Order", sizeof(Order));
+
+void *Order::operator new(size_t size)
+{
+    return order_allocator.Allocate(size);
+}
+
+void Order::operator delete(void *ptr)
+{
+    order_allocator.Free(ptr);
+}
+
 Order::Order()
 {
     allocated.Add(first_allocated_order);
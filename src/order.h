@@ -18,6 +18,8 @@ class Order
         Unit *target;
 
         Order();
+        void *operator new(size_t size);
+        void operator delete(void *ptr);
         static Order *RawAlloc() { return new Order(true); }
         ~Order() {}
 
@@ -7,6 +7,7 @@
 #include "yms.h"
 #include "unit.h"
 #include "sprite.h"
+#include "slab_allocator.h"
 
 #include <unordered_set>
 
@@ -42,15 +43,20 @@ int GetRegion(const Point &pos)
     }
 }
 
-#ifdef SYNC
+static SlabAllocator path_allocator("Path", sizeof(Path));
+
 void *Path::operator new(size_t size)
 {
-    auto ret = new uint8_t[size];
+    auto ret = path_allocator.Allocate(size);
     if (SyncTest)
         ScrambleStruct(ret, size);
     return ret;
 }
-#endif
+
+void Path::operator delete(void *ptr)
+{
+    path_allocator.Free(ptr);
+}
 
 Path::Path()
 {
@@ -42,9 +42,8 @@ class Path // 0x80
 
         uint16_t values[0x30];
 
-#ifdef SYNC
         void *operator new(size_t size);
-#endif
+        void operator delete(void *ptr);
         Path();
         ~Path();
 };
@@ -3,8 +3,13 @@
 
 #include "unitsearch.h"
 #include "yms.h"
+#include "sprite.h"
+#include "rect_filter.h"
+#include "perfclock.h"
+#include "console/assert.h"
 
 #include <algorithm>
+#include <type_traits>
 
 template <class C>
 void PosSearch<C>::Clear()
@@ -16,6 +21,7 @@ void PosSearch<C>::Clear()
     left_positions.clear();
 
     left_positions.push_back(INT_MAX - 1); // Dirty optimization: Having extra entry that is always last possible allows faster searching
+    removed_count = 0;
 }
 
 template <class C>
@@ -36,6 +42,100 @@ void PosSearch<C>::RemoveAt(uintptr_t pos)
 }
 
 
+template <class C>
+void PosSearch<C>::MarkRemoved(uintptr_t pos)
+{
+    // Keeps left position, so the array stays sorted
+    left_to_value[pos] = C();
+    left_to_right[pos] = INT_MIN;
+    left_to_top[pos] = INT_MAX;
+    left_to_bottom[pos] = INT_MIN;
+    removed_count++;
+}
+
+template <class C>
+template <class Moved>
+void PosSearch<C>::MoveEntry(uintptr_t from, uintptr_t to, Moved moved)
+{
+    left_positions[to] = left_positions[from];
+    left_to_right[to] = left_to_right[from];
+    left_to_top[to] = left_to_top[from];
+    left_to_bottom[to] = left_to_bottom[from];
+    left_to_value[to] = move(left_to_value[from]);
+    moved(left_to_value[to], to);
+}
+
+template <class C>
+template <class Moved>
+void PosSearch<C>::Compact(Moved moved)
+{
+    uintptr_t size = Size(), out = 0;
+    for (uintptr_t pos = 0; pos < size; pos++)
+    {
+        if (IsRemoved(pos))
+            continue;
+        if (pos != out)
+            MoveEntry(pos, out, moved);
+        out++;
+    }
+    left_to_value.resize(out);
+    left_to_right.resize(out);
+    left_to_top.resize(out);
+    left_to_bottom.resize(out);
+    left_positions.resize(out);
+    left_positions.push_back(INT_MAX - 1);
+    removed_count = 0;
+}
+
+template <class C>
+template <class Moved>
+uintptr_t PosSearch<C>::Insert(C &&val, const Rect16 &box, Moved moved)
+{
+    uintptr_t pos = NewFind(box.left);
+    uintptr_t size = Size();
+    if (removed_count != 0)
+    {
+        // Checks both directions one step at time, so the entries between pos and the
+        // found entry are never removed ones
+        bool found = false;
+        for (uintptr_t dist = 0; dist < ReuseDistance && !found; dist++)
+        {
+            if (pos + dist < size && IsRemoved(pos + dist))
+            {
+                for (uintptr_t i = pos + dist; i > pos; i--)
+                    MoveEntry(i - 1, i, moved);
+                found = true;
+            }
+            else if (dist < pos && IsRemoved(pos - dist - 1))
+            {
+                for (uintptr_t i = pos - dist - 1; i + 1 < pos; i++)
+                    MoveEntry(i + 1, i, moved);
+                pos--;
+                found = true;
+            }
+            else if (pos + dist >= size && dist >= pos)
+                break;
+        }
+        if (found)
+        {
+            left_positions[pos] = box.left;
+            left_to_right[pos] = box.right;
+            left_to_top[pos] = box.top;
+            left_to_bottom[pos] = box.bottom;
+            left_to_value[pos] = move(val);
+            removed_count--;
+            return pos;
+        }
+    }
+    Add(pos, move(val), box);
+    for (uintptr_t i = pos + 1; i <= size; i++)
+    {
+        if (!IsRemoved(i))
+            moved(left_to_value[i], i);
+    }
+    return pos;
+}
+
 template <class C>
 void PosSearch<C>::Add(uintptr_t pos, C &&val, const Rect16 &box)
 {
@@ -57,18 +157,24 @@ void PosSearch<C>::Find(const Rect16 &rect, C *out, C **out_end)
     beg = NewFind(find_left);
     end = NewFind(find_right);
 
-    for (unsigned int it = beg; it < end; it++)
-    {
-        if (left_to_right[it] > rect.left)
-        {
-            if (rect.top < left_to_bottom[it] && rect.bottom > left_to_top[it])
-                *out++ = left_to_value[it];
-        }
-    }
+    static_assert(std::is_pointer<C>::value, "RectFilter only handles pointers");
+    static_assert(sizeof(x32) == sizeof(int32_t) && sizeof(y32) == sizeof(int32_t), "RectFilter requires plain ints");
+    out = (C *)RectFilter((const int32_t *)left_to_right.data(), (const int32_t *)left_to_top.data(),
+            (const int32_t *)left_to_bottom.data(), (void * const *)left_to_value.data(), beg, end, rect, (void **)out);
 
     *out_end = out;
 }
 
+template <class C>
+bool PosSearch<C>::SkipByY(uintptr_t pos, const Point &point, const Rect16 &area, int max_dist) const
+{
+    // Position is inside [top, bottom), and Distance() is never less than the distance in y
+    int top = left_to_top[pos], bottom = left_to_bottom[pos];
+    if (top >= area.bottom || bottom <= area.top)
+        return true;
+    return top - point.y > max_dist || point.y - (bottom - 1) > max_dist;
+}
+
 // Not too much optimized
 template <class C>
 template <class F, class F2>
@@ -88,6 +194,11 @@ C *PosSearch<C>::FindNearest(const Point &pos, const Rect16 &area, F IsValid, F2
             int widest_right = left + max_width;
             if (widest_right < area.left || pos.x - widest_right > max_dist)
                 left_pos = -1;
+            else if (IsRemoved(left_pos) || SkipByY(left_pos, pos, area, max_dist))
+            {
+                cont = true;
+                left_pos--;
+            }
             else
             {
                 cont = true;
@@ -108,12 +219,23 @@ C *PosSearch<C>::FindNearest(const Point &pos, const Rect16 &area, F IsValid, F2
                 left_pos--;
             }
         }
-        if (right_pos < (int)Size())
+        if (right_pos < (int)Size() && IsRemoved(right_pos))
+        {
+            // Removed entries have no valid right
+            cont = true;
+            right_pos++;
+        }
+        else if (right_pos < (int)Size())
         {
             int right = left_to_right[right_pos];
             int widest_left = right - max_width;
             if (widest_left > area.right || widest_left - pos.x > max_dist)
                 right_pos = Size();
+            else if (SkipByY(right_pos, pos, area, max_dist))
+            {
+                cont = true;
+                right_pos++;
+            }
             else
             {
                 cont = true;
@@ -138,4 +260,197 @@ C *PosSearch<C>::FindNearest(const Point &pos, const Rect16 &area, F IsValid, F2
     return closest;
 }
 
+// Keeps the k smallest (distance, key) pairs seen so far, sorted
+template <class Value, int MaxSize>
+class KNearestList
+{
+    public:
+        KNearestList(int k_, Value *out_) : k(k_), count(0), out(out_) {}
+
+        int Count() const { return count; }
+        /// Anything further than this cannot be added anymore
+        int Limit() const { return count == k ? dists[k - 1] : INT_MAX; }
+        bool Accepts(int dist, uint32_t key) const
+        {
+            if (count < k)
+                return true;
+            return dist < dists[k - 1] || (dist == dists[k - 1] && key < keys[k - 1]);
+        }
+        // Accepts() must be true
+        void Add(int dist, uint32_t key, Value value)
+        {
+            int pos = count;
+            if (count < k)
+                count++;
+            else
+                pos = k - 1;
+            while (pos > 0 && (dists[pos - 1] > dist || (dists[pos - 1] == dist && keys[pos - 1] > key)))
+            {
+                dists[pos] = dists[pos - 1];
+                keys[pos] = keys[pos - 1];
+                out[pos] = out[pos - 1];
+                pos--;
+            }
+            dists[pos] = dist;
+            keys[pos] = key;
+            out[pos] = value;
+        }
+
+    private:
+        int k;
+        int count;
+        Value *out;
+        int dists[MaxSize];
+        uint32_t keys[MaxSize];
+};
+
+// Walks both directions like FindNearest, but the y arrays are checked before touching the value,
+// and the walk stops once the k-th best distance is closer than anything remaining in x.
+template <class C>
+template <class F, class F2>
+int PosSearch<C>::FindKNearest(const Point &pos, const Rect16 &area, int k, C *out, F IsValid, F2 Position)
+{
+    Assert(k <= MaxKNearest);
+    if (k <= 0 || area.right <= area.left || area.bottom <= area.top)
+        return 0;
+
+    KNearestList<C, MaxKNearest> list(k, out);
+    auto Check = [&](int index) {
+        if (SkipByY(index, pos, area, list.Limit()))
+            return;
+        if ((int)left_positions[index] >= area.right || (int)left_to_right[index] <= area.left)
+            return;
+        C &value = left_to_value[index];
+        Point val_pos = Position(value);
+        if (val_pos.x < area.left || val_pos.x >= area.right || val_pos.y < area.top || val_pos.y >= area.bottom)
+            return;
+        int dist = Distance(pos, val_pos);
+        if (list.Accepts(dist, index) && IsValid(value))
+            list.Add(dist, index, value);
+    };
+
+    int right_pos = NewFind(pos.x);
+    int left_pos = right_pos - 1;
+    while (left_pos >= 0 || right_pos < (int)Size())
+    {
+        if (left_pos >= 0)
+        {
+            // Entries left of this have right <= left + max_width, and position is left of right
+            int widest_right = left_positions[left_pos] + max_width;
+            if (widest_right <= area.left || pos.x - widest_right >= list.Limit())
+                left_pos = -1;
+            else
+                Check(left_pos--);
+        }
+        if (right_pos < (int)Size())
+        {
+            // Tombstones keep their left position, so this works with them as well
+            int left = left_positions[right_pos];
+            if (left >= area.right || left - pos.x > list.Limit())
+                right_pos = Size();
+            else
+                Check(right_pos++);
+        }
+    }
+    return list.Count();
+}
+
+template <class Func>
+Unit *MainUnitSearch::FindNearest(const Point &pos, const Rect16 &area, Func IsValid)
+{
+    if (!UseGrid())
+        return UnitSearch::FindNearest(pos, area, IsValid);
+
+    Unit **candidates = NewEntry();
+    Unit **end = GridFindNearestCandidates(pos, area, candidates);
+    Unit *closest = nullptr;
+    int max_dist = INT_MAX;
+    for (Unit **it = candidates; it != end; ++it)
+    {
+        int dist = Distance(pos, (*it)->sprite->position);
+        if (dist < max_dist && IsValid(*it))
+        {
+            closest = *it;
+            max_dist = dist;
+        }
+    }
+    PopResult();
+    if (Debug)
+        Assert(closest == UnitSearch::FindNearest(pos, area, IsValid));
+    return closest;
+}
+
+template <class Func>
+int MainUnitSearch::FindKNearest(const Point &pos, const Rect16 &area, int k, Unit **out, Func IsValid)
+{
+    STATIC_PERF_CLOCK(UnitSearch_FindKNearest);
+    if (!UseGrid())
+        return UnitSearch::FindKNearest(pos, area, k, out, IsValid);
+
+    Assert(k <= MaxKNearest);
+    if (k <= 0 || area.right <= area.left || area.bottom <= area.top)
+        return 0;
+
+    // Visits the cells in rings around pos, until the k-th best distance is closer than any
+    // cell that has not been visited. A long line of units in y costs only the cells near
+    // pos, while the arrays would have to check every unit of the line which is close in x.
+    KNearestList<Unit *, MaxKNearest> list(k, out);
+    int center_x = grid.CellX(pos.x), center_y = grid.CellY(pos.y);
+    int area_left = grid.CellX(area.left), area_right = grid.CellX(area.right - 1);
+    int area_top = grid.CellY(area.top), area_bottom = grid.CellY(area.bottom - 1);
+    auto CheckCell = [&](int x, int y) {
+        grid.ForEachInCell(x, y, [&](Unit *unit) {
+            const auto &val_pos = unit->sprite->position;
+            // Units are in every cell their rect touches, but only checked in the cell of their position
+            if (grid.CellX(val_pos.x) != x || grid.CellY(val_pos.y) != y)
+                return;
+            if (val_pos.x < area.left || val_pos.x >= area.right || val_pos.y < area.top || val_pos.y >= area.bottom)
+                return;
+            int dist = Distance(pos, val_pos);
+            if (list.Accepts(dist, unit->search_left) && IsValid(unit))
+                list.Add(dist, unit->search_left, unit);
+        });
+    };
+    for (int ring = 0; ; ring++)
+    {
+        int left = center_x - ring, right = center_x + ring;
+        int top = center_y - ring, bottom = center_y + ring;
+        for (int y = std::max(top, area_top); y <= std::min(bottom, area_bottom); y++)
+        {
+            if (y == top || y == bottom)
+            {
+                for (int x = std::max(left, area_left); x <= std::min(right, area_right); x++)
+                    CheckCell(x, y);
+            }
+            else
+            {
+                if (left >= area_left && left <= area_right)
+                    CheckCell(left, y);
+                if (right != left && right >= area_left && right <= area_right)
+                    CheckCell(right, y);
+            }
+        }
+        // Closest possible distance of a unit in a cell outside the rings visited so far
+        int min_dist = INT_MAX;
+        if (left > area_left)
+            min_dist = std::min(min_dist, pos.x - left * UnitSearchGrid::CellSize + 1);
+        if (right < area_right)
+            min_dist = std::min(min_dist, (right + 1) * UnitSearchGrid::CellSize - pos.x);
+        if (top > area_top)
+            min_dist = std::min(min_dist, pos.y - top * UnitSearchGrid::CellSize + 1);
+        if (bottom < area_bottom)
+            min_dist = std::min(min_dist, (bottom + 1) * UnitSearchGrid::CellSize - pos.y);
+        if (min_dist == INT_MAX || min_dist > list.Limit())
+            break;
+    }
+    int count = list.Count();
+    if (Debug)
+    {
+        Unit *check[MaxKNearest];
+        Assert(count == UnitSearch::FindKNearest(pos, area, k, check, IsValid));
+        Assert(std::equal(out, out + count, check));
+    }
+    return count;
+}
+
 #endif /* POSSEARCH_HPP */
@@ -0,0 +1,91 @@
+#include "rect_filter.h"
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "cpu.h"
+
+// The matching values are always written, but out is only advanced for ones that passed,
+// which avoids branching on each entry
+static inline void **CompactMasked(void * const *values, unsigned int mask, unsigned int count, void **out)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        *out = values[i];
+        out += (mask >> i) & 1;
+    }
+    return out;
+}
+
+static void **RectFilter_Scalar(const int32_t *right, const int32_t *top, const int32_t *bottom, void * const *values,
+        unsigned int beg, unsigned int end, const Rect16 &rect, void **out)
+{
+    int left = rect.left, top_limit = rect.top, bottom_limit = rect.bottom;
+    for (unsigned int it = beg; it < end; it++)
+    {
+        if (right[it] > left)
+        {
+            if (top_limit < bottom[it] && bottom_limit > top[it])
+                *out++ = values[it];
+        }
+    }
+    return out;
+}
+
+TARGET_SSE2
+static void **RectFilter_Sse2(const int32_t *right, const int32_t *top, const int32_t *bottom, void * const *values,
+        unsigned int beg, unsigned int end, const Rect16 &rect, void **out)
+{
+    const __m128i left = _mm_set1_epi32(rect.left);
+    const __m128i top_limit = _mm_set1_epi32(rect.top);
+    const __m128i bottom_limit = _mm_set1_epi32(rect.bottom);
+    unsigned int it = beg;
+    for (; it + 4 <= end; it += 4)
+    {
+        __m128i r = _mm_loadu_si128((const __m128i *)(right + it));
+        __m128i t = _mm_loadu_si128((const __m128i *)(top + it));
+        __m128i b = _mm_loadu_si128((const __m128i *)(bottom + it));
+        __m128i match = _mm_and_si128(_mm_cmpgt_epi32(r, left), _mm_cmpgt_epi32(b, top_limit));
+        match = _mm_and_si128(match, _mm_cmpgt_epi32(bottom_limit, t));
+        unsigned int mask = _mm_movemask_ps(_mm_castsi128_ps(match));
+        if (mask != 0)
+            out = CompactMasked(values + it, mask, 4, out);
+    }
+    return RectFilter_Scalar(right, top, bottom, values, it, end, rect, out);
+}
+
+TARGET_AVX2
+static void **RectFilter_Avx2(const int32_t *right, const int32_t *top, const int32_t *bottom, void * const *values,
+        unsigned int beg, unsigned int end, const Rect16 &rect, void **out)
+{
+    const __m256i left = _mm256_set1_epi32(rect.left);
+    const __m256i top_limit = _mm256_set1_epi32(rect.top);
+    const __m256i bottom_limit = _mm256_set1_epi32(rect.bottom);
+    unsigned int it = beg;
+    for (; it + 8 <= end; it += 8)
+    {
+        __m256i r = _mm256_loadu_si256((const __m256i *)(right + it));
+        __m256i t = _mm256_loadu_si256((const __m256i *)(top + it));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(bottom + it));
+        __m256i match = _mm256_and_si256(_mm256_cmpgt_epi32(r, left), _mm256_cmpgt_epi32(b, top_limit));
+        match = _mm256_and_si256(match, _mm256_cmpgt_epi32(bottom_limit, t));
+        unsigned int mask = _mm256_movemask_ps(_mm256_castsi256_ps(match));
+        if (mask != 0)
+            out = CompactMasked(values + it, mask, 8, out);
+    }
+    return RectFilter_Scalar(right, top, bottom, values, it, end, rect, out);
+}
+
+void **RectFilter(const int32_t *right, const int32_t *top, const int32_t *bottom, void * const *values,
+        unsigned int beg, unsigned int end, const Rect16 &rect, void **out)
+{
+    // Short ranges are not worth it
+    if (end - beg >= 8)
+    {
+        if (Cpu::HasAvx2())
+            return RectFilter_Avx2(right, top, bottom, values, beg, end, rect, out);
+        if (Cpu::HasSse2())
+            return RectFilter_Sse2(right, top, bottom, values, beg, end, rect, out);
+    }
+    return RectFilter_Scalar(right, top, bottom, values, beg, end, rect, out);
+}
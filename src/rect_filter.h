@@ -0,0 +1,13 @@
+#ifndef RECT_FILTER_H
+#define RECT_FILTER_H
+
+#include "types.h"
+
+// Filtering part of PosSearch::Find, picking the vectorized version the cpu supports.
+// Copies values[i] for each i in [beg, end) where right[i] > rect.left, bottom[i] > rect.top
+// and top[i] < rect.bottom to out, keeping their order. Returns the end of output.
+// The entry right after the output may be written to as well.
+void **RectFilter(const int32_t *right, const int32_t *top, const int32_t *bottom, void * const *values,
+        unsigned int beg, unsigned int end, const Rect16 &rect, void **out);
+
+#endif // RECT_FILTER_H
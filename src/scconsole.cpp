@@ -22,6 +22,9 @@
 #include "bullet.h"
 #include "test_game.h"
 #include "ai_hit_reactions.h"
+#include "frame_graph.h"
+#include "cpu.h"
+#include "slab_allocator.h"
 
 #include <string>
 #include <algorithm>
@@ -53,6 +56,10 @@ ScConsole::ScConsole()
     AddCommand("give", &ScConsole::Give);
     AddCommand("gsw", &ScConsole::Gsw);
     AddCommand("vis", &ScConsole::Vis);
+    AddCommand("phases", &ScConsole::Phases);
+    AddCommand("simd", &ScConsole::Simd);
+    AddCommand("unitsearch", &ScConsole::UnitSearchBackend);
+    AddCommand("alloc", &ScConsole::Alloc);
     AddCommand("tcr", &ScConsole::Tcr);
     AddCommand("trigger_speed", &ScConsole::Tcr);
     AddCommand("supplymax", &ScConsole::SupplyMax);
@@ -360,6 +367,50 @@ bool ScConsole::Vis(const CmdArgs &args)
     return true;
 }
 
+bool ScConsole::Phases(const CmdArgs &args)
+{
+    if (strcmp(args[1], "parallel") == 0)
+        parallel_frame_phases = true;
+    else if (strcmp(args[1], "serial") == 0)
+        parallel_frame_phases = false;
+    else
+        return false;
+    return true;
+}
+
+bool ScConsole::Simd(const CmdArgs &args)
+{
+    if (strcmp(args[1], "on") == 0)
+        Cpu::DisableSimd(false);
+    else if (strcmp(args[1], "off") == 0)
+        Cpu::DisableSimd(true);
+    else
+        return false;
+    return true;
+}
+
+bool ScConsole::UnitSearchBackend(const CmdArgs &args)
+{
+    if (strcmp(args[1], "grid") == 0)
+        unit_search->SetGridEnabled(true);
+    else if (strcmp(args[1], "array") == 0)
+        unit_search->SetGridEnabled(false);
+    else
+        return false;
+    return true;
+}
+
+bool ScConsole::Alloc(const CmdArgs &args)
+{
+    if (strcmp(args[1], "slab") == 0)
+        slab_allocators_enabled = true;
+    else if (strcmp(args[1], "system") == 0)
+        slab_allocators_enabled = false;
+    else
+        return false;
+    return true;
+}
+
 bool ScConsole::Gsw(const CmdArgs &args)
 {
     if (!IsInGame() || !isdigit(*args[1]))
@@ -43,6 +43,10 @@ class ScConsole : public Common::GenericConsole
         bool Self(const CmdArgs &args);
         bool Pause(const CmdArgs &args);
         bool Vis(const CmdArgs &args);
+        bool Phases(const CmdArgs &args);
+        bool Simd(const CmdArgs &args);
+        bool UnitSearchBackend(const CmdArgs &args);
+        bool Alloc(const CmdArgs &args);
         bool Cmd_Grid(const CmdArgs &args);
 
         bool Frame(const CmdArgs &args);
@@ -1,3 +1,112 @@
 #include "scthread.h"
 
+#include <algorithm>
+
+#include "console/assert.h"
+
 ThreadPool<ScThreadVars> *threads;
+
+// Created on first use, as TempMemoryPool reserves its memory immediately
+static ptr<ScThreadVars> caller_thread_vars;
+static std::atomic<int> live_state_count(0);
+
+void ClearCallerThreadVars()
+{
+    if (caller_thread_vars)
+        caller_thread_vars->unit_search_pool.ClearAll();
+}
+
+ParallelJob::ParallelJob(uint32_t begin_, uint32_t end_, uint32_t grain_)
+{
+    Assert(grain_ != 0);
+    begin = begin_;
+    end = end_;
+    grain = grain_;
+    if (end > begin)
+        chunk_count = (end - begin - 1) / grain + 1;
+    else
+        chunk_count = 0;
+}
+
+void ParallelJob::ProcessChunks(SharedState *state, ScThreadVars *vars)
+{
+    while (true)
+    {
+        uint32_t chunk = state->next_chunk.fetch_add(1, std::memory_order_relaxed);
+        if (chunk >= state->chunk_count)
+            return;
+        ParallelJob *job = state->job;
+        uint32_t chunk_begin = job->begin + chunk * job->grain;
+        uint32_t chunk_end = chunk_begin + job->grain;
+        if (chunk_end > job->end || chunk_end < chunk_begin)
+            chunk_end = job->end;
+        job->RunChunk(vars, chunk, chunk_begin, chunk_end);
+        state->done_chunks.fetch_add(1, std::memory_order_release);
+    }
+}
+
+int ParallelJob::LiveStateCount()
+{
+    return live_state_count.load(std::memory_order_acquire);
+}
+
+void ParallelJob::Release(SharedState *state)
+{
+    if (state->references.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete state;
+        live_state_count.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+void ParallelJob::HelperTask(ScThreadVars *vars, SharedState *state)
+{
+    ProcessChunks(state, vars);
+    Release(state);
+}
+
+void ParallelJob::CancelHelper(SharedState *state)
+{
+    Release(state);
+}
+
+void ParallelJob::Run(uint32_t max_helpers)
+{
+    if (chunk_count == 0)
+        return;
+
+    SharedState *state = new SharedState;
+    live_state_count.fetch_add(1, std::memory_order_relaxed);
+    state->job = this;
+    state->chunk_count = chunk_count;
+    state->next_chunk.store(0, std::memory_order_relaxed);
+    state->done_chunks.store(0, std::memory_order_relaxed);
+
+    PoolThread<ScThreadVars> *self = threads != nullptr ? threads->CurrentThread() : nullptr;
+    if (self != nullptr)
+    {
+        // Waiting for helpers from a worker could deadlock if every worker did the same,
+        // so nested jobs are just done by the worker itself
+        state->references.store(1, std::memory_order_relaxed);
+        ProcessChunks(state, self->thread_variables);
+        Release(state);
+        return;
+    }
+
+    if (!caller_thread_vars)
+        caller_thread_vars.reset(new ScThreadVars);
+
+    uint32_t helper_count = 0;
+    if (threads != nullptr)
+        helper_count = std::min(std::min((uint32_t)threads->GetThreadCount(), chunk_count - 1), max_helpers);
+    state->references.store(helper_count + 1, std::memory_order_relaxed);
+    for (uint32_t i = 0; i < helper_count; i++)
+        threads->AddTask(&HelperTask, state, &CancelHelper);
+
+    ProcessChunks(state, caller_thread_vars.get());
+    // Helpers may still be finishing their last chunks, but the ones which haven't
+    // started yet don't need to be waited for
+    while (state->done_chunks.load(std::memory_order_acquire) != chunk_count)
+        SwitchToThread();
+    Release(state);
+}
@@ -1,6 +1,9 @@
 #ifndef SCTHREAD_H
 #define SCTHREAD_H
 
+#include <atomic>
+#include <stdint.h>
+#include <type_traits>
 #include "thread.h"
 #include "memory.h"
 
@@ -11,5 +14,121 @@ struct ScThreadVars
 
 extern ThreadPool<ScThreadVars> *threads;
 
-#endif // SCTHREAD_H
+// Splits [begin, end) to chunks of `grain` entries, which are then claimed in order by
+// the caller and helper tasks. Chunk boundaries depend only on the range and grain,
+// never on thread count or timing.
+class ParallelJob
+{
+    public:
+        ParallelJob(uint32_t begin_, uint32_t end_, uint32_t grain_);
+        virtual ~ParallelJob() {}
+
+        // Blocks until every chunk has been processed, using at most max_helpers worker threads.
+        // Helper tasks which get to run only after that just return.
+        void Run(uint32_t max_helpers = UINT32_MAX);
+
+        uint32_t ChunkCount() const { return chunk_count; }
+
+        // States which still have helper tasks queued or running, for testing
+        static int LiveStateCount();
+
+    protected:
+        virtual void RunChunk(ScThreadVars *vars, uint32_t chunk, uint32_t chunk_begin, uint32_t chunk_end) = 0;
+
+    private:
+        // Shared with the helper tasks, which may still be queued after Run has returned
+        // and the job itself is gone. Job is only accessed after claiming a chunk, which
+        // cannot happen anymore once all chunks are done. Freed with the last reference,
+        // helpers discarded by ThreadPool::ClearAll release theirs in CancelHelper.
+        struct SharedState
+        {
+            ParallelJob *job;
+            uint32_t chunk_count;
+            std::atomic<uint32_t> next_chunk;
+            std::atomic<uint32_t> done_chunks;
+            std::atomic<uint32_t> references;
+        };
+
+        static void HelperTask(ScThreadVars *vars, SharedState *state);
+        static void CancelHelper(SharedState *state);
+        static void ProcessChunks(SharedState *state, ScThreadVars *vars);
+        static void Release(SharedState *state);
+
+        uint32_t begin;
+        uint32_t end;
+        uint32_t grain;
+        uint32_t chunk_count;
+};
+
+template <typename Func>
+class ParallelForJob : public ParallelJob
+{
+    public:
+        ParallelForJob(uint32_t begin, uint32_t end, uint32_t grain, Func &func_) :
+            ParallelJob(begin, end, grain), func(func_) {}
+
+    protected:
+        virtual void RunChunk(ScThreadVars *vars, uint32_t chunk, uint32_t chunk_begin, uint32_t chunk_end) override
+        {
+            func(vars, chunk_begin, chunk_end);
+        }
+
+    private:
+        Func &func;
+};
+
+template <typename Result, typename Func>
+class ParallelReduceJob : public ParallelJob
+{
+    public:
+        ParallelReduceJob(uint32_t begin, uint32_t end, uint32_t grain, Func &func_) :
+            ParallelJob(begin, end, grain), func(func_), results(ChunkCount()) {}
+
+        // Vector<bool> would pack the results of adjacent chunks in a same word
+        static_assert(!std::is_same<Result, bool>::value, "Chunks write their results concurrently");
+
+        std::vector<Result> &Results() { return results; }
+
+    protected:
+        virtual void RunChunk(ScThreadVars *vars, uint32_t chunk, uint32_t chunk_begin, uint32_t chunk_end) override
+        {
+            results[chunk] = func(vars, chunk_begin, chunk_end);
+        }
+
+    private:
+        Func &func;
+        std::vector<Result> results;
+};
+
+// Calls func(ScThreadVars *vars, uint32_t chunk_begin, uint32_t chunk_end) for every chunk of
+// [begin, end), and returns once all of them are done. A chunk is processed by a single thread,
+// and vars->unit_search_pool can be used as its scratch memory, it is not used by any other
+// chunk running simultaneously. The memory is freed at end of bullet frames.
+// Func may only read shared state, as the chunks run in unspecified order.
+// Max_helpers limits how many worker threads may help, which is mainly useful for testing.
+template <typename Func>
+void ParallelFor(uint32_t begin, uint32_t end, uint32_t grain, Func func, uint32_t max_helpers = UINT32_MAX)
+{
+    ParallelForJob<Func> job(begin, end, grain, func);
+    job.Run(max_helpers);
+}
 
+// Like ParallelFor, but func returns a Result for its chunk. The chunk results are then
+// folded as combine(combine(combine(identity, first), second), ...) in chunk order,
+// so the result is identical regardless of how many threads did the work.
+template <typename Result, typename Func, typename Combine>
+Result ParallelReduce(uint32_t begin, uint32_t end, uint32_t grain, Result identity, Func func, Combine combine,
+        uint32_t max_helpers = UINT32_MAX)
+{
+    ParallelReduceJob<Result, Func> job(begin, end, grain, func);
+    job.Run(max_helpers);
+    Result result = identity;
+    for (auto &chunk_result : job.Results())
+        result = combine(result, chunk_result);
+    return result;
+}
+
+// Scratch memory for ParallelFor chunks that are run by the calling (main) thread
+void ClearCallerThreadVars();
+
+#endif // SCTHREAD_H
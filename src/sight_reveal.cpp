@@ -0,0 +1,78 @@
+#include "sight_reveal.h"
+
+#include <algorithm>
+
+#include "unit.h"
+#include "sprite.h"
+#include "offsets.h"
+#include "console/assert.h"
+
+bool SightRevealer::Key::operator==(const Key &other) const
+{
+    return position == other.position && sprite_position == other.sprite_position && flags == other.flags &&
+        visions == other.visions && unit_id == other.unit_id && sight_range == other.sight_range &&
+        player == other.player && blind == other.blind;
+}
+
+size_t SightRevealer::KeyHash::operator()(const Key &key) const
+{
+    uint32_t hash = key.sprite_position.x | (uint32_t)key.sprite_position.y << 16;
+    hash = hash * 0x9e3779b1 ^ (key.position.x | (uint32_t)key.position.y << 16);
+    hash = hash * 0x9e3779b1 ^ key.flags;
+    hash = hash * 0x9e3779b1 ^ key.visions;
+    hash = hash * 0x9e3779b1 ^ (key.unit_id | key.sight_range << 16 | key.player << 24);
+    hash = hash * 0x9e3779b1 ^ key.blind;
+    return hash;
+}
+
+void SightRevealer::Clear()
+{
+    revealed.clear();
+    revealed_count = 0;
+    skipped_count = 0;
+}
+
+void SightRevealer::Reveal(Unit *unit)
+{
+    Key key;
+    key.position = unit->position;
+    key.sprite_position = unit->sprite->position;
+    key.flags = unit->flags;
+    key.visions = bw::visions[unit->player];
+    key.unit_id = unit->unit_id;
+    key.sight_range = unit->GetSightRange(false);
+    key.player = unit->player;
+    key.blind = unit->blind;
+    if (revealed.insert(key).second)
+    {
+        RevealSightArea(unit);
+        revealed_count++;
+    }
+    else
+    {
+        skipped_count++;
+        if (Debug)
+            CheckSkippedReveal(unit);
+    }
+}
+
+void SightRevealer::CheckSkippedReveal(Unit *unit)
+{
+    // Sight ranges are at most 11 tiles, the window is a bit larger just in case
+    const int radius = 13;
+    int width = *bw::map_width_tiles, height = *bw::map_height_tiles;
+    int x_tile = unit->sprite->position.x / 32, y_tile = unit->sprite->position.y / 32;
+    int left = std::max(x_tile - radius, 0), right = std::min(x_tile + radius + 1, width);
+    int top = std::max(y_tile - radius, 0), bottom = std::min(y_tile + radius + 1, height);
+    vector<uint32_t> before;
+    for (int y = top; y < bottom; y++)
+        before.insert(before.end(), *bw::map_tile_flags + y * width + left, *bw::map_tile_flags + y * width + right);
+
+    RevealSightArea(unit);
+    auto pos = before.begin();
+    for (int y = top; y < bottom; y++)
+    {
+        Assert(std::equal(*bw::map_tile_flags + y * width + left, *bw::map_tile_flags + y * width + right, pos));
+        pos += right - left;
+    }
+}
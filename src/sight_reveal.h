@@ -0,0 +1,54 @@
+#ifndef SIGHT_REVEAL_H
+#define SIGHT_REVEAL_H
+
+#include "types.h"
+#include <unordered_set>
+
+// Calls RevealSightArea for units, skipping the units which would reveal the same area as
+// another unit has already revealed since last Clear(). RevealSightArea only clears the fog bits
+// of map_tile_flags, so revealing an area again does nothing, but bw still goes through the sight
+// circle one tile at time. Stacked units usually have identical sight, and are skipped.
+//
+// The key contains the unit's position, sight range and everything else RevealSightArea reads
+// from the unit and its player. Debug builds reveal the skipped units anyways and assert that
+// no tile changes.
+class SightRevealer
+{
+    public:
+        SightRevealer() : revealed_count(0), skipped_count(0) {}
+
+        // Has to be called whenever the fog bits may have been set again (UpdateFog)
+        void Clear();
+        void Reveal(Unit *unit);
+
+        int RevealedCount() const { return revealed_count; }
+        int SkippedCount() const { return skipped_count; }
+
+    private:
+        struct Key
+        {
+            Point position;
+            Point sprite_position;
+            uint32_t flags;
+            uint32_t visions;
+            uint16_t unit_id;
+            // Sight upgrades can finish between two stacked units being revealed
+            uint8_t sight_range;
+            uint8_t player;
+            uint8_t blind;
+
+            bool operator==(const Key &other) const;
+        };
+        struct KeyHash
+        {
+            size_t operator()(const Key &key) const;
+        };
+
+        void CheckSkippedReveal(Unit *unit);
+
+        std::unordered_set<Key, KeyHash> revealed;
+        int revealed_count;
+        int skipped_count;
+};
+
+#endif // SIGHT_REVEAL_H
@@ -0,0 +1,94 @@
+#include "slab_allocator.h"
+
+#include <algorithm>
+
+#include "log.h"
+#include "console/assert.h"
+
+bool slab_allocators_enabled = true;
+SlabAllocator *SlabAllocator::first_allocator = nullptr;
+
+SlabAllocator::SlabAllocator(const char *name, uint32_t object_size, uint32_t slab_objects) : name(name),
+    slab_objects(slab_objects), free_list(nullptr), live(0), peak(0)
+{
+    // Freed objects store the free list pointer, and every object has to stay aligned
+    this->object_size = (std::max(object_size, (uint32_t)sizeof(FreeObject)) + 7) & ~7;
+    next_allocator = first_allocator;
+    first_allocator = this;
+}
+
+void SlabAllocator::AddSlab()
+{
+    uint8_t *slab = new uint8_t[slab_objects * object_size];
+    slabs.insert(std::upper_bound(slabs.begin(), slabs.end(), slab), slab);
+    // Pushed in reverse, so the objects are given out in address order
+    for (uint32_t i = slab_objects; i > 0; i--)
+    {
+        FreeObject *obj = (FreeObject *)(slab + (i - 1) * object_size);
+        obj->next = free_list;
+        free_list = obj;
+    }
+}
+
+bool SlabAllocator::InSlab(void *ptr) const
+{
+    auto next_slab = std::upper_bound(slabs.begin(), slabs.end(), (uint8_t *)ptr);
+    if (next_slab == slabs.begin())
+        return false;
+    uint8_t *slab = *(next_slab - 1);
+    return (uint8_t *)ptr < slab + slab_objects * object_size;
+}
+
+void *SlabAllocator::Allocate(size_t size)
+{
+    live++;
+    peak = std::max(peak, live);
+    if (!slab_allocators_enabled || size > object_size)
+        return new uint8_t[size];
+
+    if (free_list == nullptr)
+        AddSlab();
+    FreeObject *obj = free_list;
+    free_list = obj->next;
+    return obj;
+}
+
+void SlabAllocator::Free(void *ptr)
+{
+    if (ptr == nullptr)
+        return;
+    Assert(live != 0);
+    live--;
+    if (!InSlab(ptr))
+    {
+        delete[] (uint8_t *)ptr;
+        return;
+    }
+    Assert(((uint8_t *)ptr - *(std::upper_bound(slabs.begin(), slabs.end(), (uint8_t *)ptr) - 1)) % object_size == 0);
+    FreeObject *obj = (FreeObject *)ptr;
+    obj->next = free_list;
+    free_list = obj;
+}
+
+SlabAllocatorStats SlabAllocator::Stats() const
+{
+    SlabAllocatorStats stats;
+    stats.live = live;
+    stats.peak = peak;
+    stats.slabs = slabs.size();
+    stats.bytes = slabs.size() * slab_objects * object_size;
+    return stats;
+}
+
+void SlabAllocator::LogStats()
+{
+    perf_log->Log("Slab allocators (%s):\n", slab_allocators_enabled ? "enabled" : "disabled");
+    perf_log->Indent(2);
+    for (SlabAllocator *alloc = first_allocator; alloc != nullptr; alloc = alloc->next_allocator)
+    {
+        auto stats = alloc->Stats();
+        perf_log->Log("%s: %d live, %d peak, %d slabs, %d KB\n", alloc->Name(), stats.live, stats.peak,
+                stats.slabs, stats.bytes / 1024);
+    }
+    perf_log->Indent(-2);
+}
@@ -0,0 +1,65 @@
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include "types.h"
+
+struct SlabAllocatorStats
+{
+    uint32_t live;
+    uint32_t peak;
+    uint32_t slabs;
+    uint32_t bytes;
+};
+
+// Allocates objects of a single type from large slabs, and keeps freed objects in
+// a free list, so the objects which are created and deleted constantly (bullets, sprites,
+// images, orders, paths) do not go through the system allocator every time.
+// Objects never move, and slabs are never released, so the next game reuses them.
+// Not thread-safe: each type has to be allocated only by one thread at a time, which is
+// already required by the frame phases touching them.
+class SlabAllocator
+{
+    public:
+        // Allocators are meant to be static objects, they are never destroyed
+        SlabAllocator(const char *name, uint32_t object_size, uint32_t slab_objects = 256);
+        SlabAllocator(const SlabAllocator &other) = delete;
+
+        // Falls back to the system allocator if slab allocators are disabled,
+        // or size is not the one allocator was created for (derived classes).
+        void *Allocate(size_t size);
+        // Accepts also pointers from the system allocator, so allocators can be toggled at any time
+        void Free(void *ptr);
+
+        SlabAllocatorStats Stats() const;
+        const char *Name() const { return name; }
+
+        // Logs stats of every allocator to perf_log
+        static void LogStats();
+
+    private:
+        struct FreeObject
+        {
+            FreeObject *next;
+        };
+
+        void AddSlab();
+        bool InSlab(void *ptr) const;
+
+        const char *name;
+        uint32_t object_size;
+        uint32_t slab_objects;
+        FreeObject *free_list;
+        // Sorted by address
+        vector<uint8_t *> slabs;
+        uint32_t live;
+        uint32_t peak;
+
+        SlabAllocator *next_allocator;
+        static SlabAllocator *first_allocator;
+};
+
+// Disabling makes new objects use the system allocator, allowing A/B comparisons.
+// Objects allocated before toggling are still freed correctly.
+extern bool slab_allocators_enabled;
+
+#endif // SLAB_ALLOCATOR_H
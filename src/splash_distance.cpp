@@ -0,0 +1,91 @@
+#include "splash_distance.h"
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#include "cpu.h"
+
+// Boxes are never narrower than -1 (right == left - 1), so at most one of
+// left - x and x - right is positive, and the distance is the larger of them and 0
+static void SplashAxisDistances_Scalar(const int32_t *left, const int32_t *top, const int32_t *right,
+        const int32_t *bottom, unsigned int beg, unsigned int end, int x, int y, int32_t *x_dist, int32_t *y_dist)
+{
+    for (unsigned int i = beg; i < end; i++)
+    {
+        int w = 0, h = 0;
+        if (x < left[i])
+            w = left[i] - x;
+        else if (x > right[i])
+            w = x - right[i];
+        if (y < top[i])
+            h = top[i] - y;
+        else if (y > bottom[i])
+            h = y - bottom[i];
+        x_dist[i] = w;
+        y_dist[i] = h;
+    }
+}
+
+TARGET_SSE2
+static inline __m128i Max_Sse2(__m128i a, __m128i b)
+{
+    __m128i a_greater = _mm_cmpgt_epi32(a, b);
+    return _mm_or_si128(_mm_and_si128(a_greater, a), _mm_andnot_si128(a_greater, b));
+}
+
+TARGET_SSE2
+static void SplashAxisDistances_Sse2(const int32_t *left, const int32_t *top, const int32_t *right,
+        const int32_t *bottom, unsigned int count, int x, int y, int32_t *x_dist, int32_t *y_dist)
+{
+    const __m128i pos_x = _mm_set1_epi32(x);
+    const __m128i pos_y = _mm_set1_epi32(y);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i l = _mm_loadu_si128((const __m128i *)(left + i));
+        __m128i r = _mm_loadu_si128((const __m128i *)(right + i));
+        __m128i t = _mm_loadu_si128((const __m128i *)(top + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(bottom + i));
+        __m128i w = Max_Sse2(Max_Sse2(_mm_sub_epi32(l, pos_x), _mm_sub_epi32(pos_x, r)), zero);
+        __m128i h = Max_Sse2(Max_Sse2(_mm_sub_epi32(t, pos_y), _mm_sub_epi32(pos_y, b)), zero);
+        _mm_storeu_si128((__m128i *)(x_dist + i), w);
+        _mm_storeu_si128((__m128i *)(y_dist + i), h);
+    }
+    SplashAxisDistances_Scalar(left, top, right, bottom, i, count, x, y, x_dist, y_dist);
+}
+
+TARGET_AVX2
+static void SplashAxisDistances_Avx2(const int32_t *left, const int32_t *top, const int32_t *right,
+        const int32_t *bottom, unsigned int count, int x, int y, int32_t *x_dist, int32_t *y_dist)
+{
+    const __m256i pos_x = _mm256_set1_epi32(x);
+    const __m256i pos_y = _mm256_set1_epi32(y);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i l = _mm256_loadu_si256((const __m256i *)(left + i));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(right + i));
+        __m256i t = _mm256_loadu_si256((const __m256i *)(top + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(bottom + i));
+        __m256i w = _mm256_max_epi32(_mm256_max_epi32(_mm256_sub_epi32(l, pos_x), _mm256_sub_epi32(pos_x, r)), zero);
+        __m256i h = _mm256_max_epi32(_mm256_max_epi32(_mm256_sub_epi32(t, pos_y), _mm256_sub_epi32(pos_y, b)), zero);
+        _mm256_storeu_si256((__m256i *)(x_dist + i), w);
+        _mm256_storeu_si256((__m256i *)(y_dist + i), h);
+    }
+    SplashAxisDistances_Scalar(left, top, right, bottom, i, count, x, y, x_dist, y_dist);
+}
+
+void SplashAxisDistances(const int32_t *left, const int32_t *top, const int32_t *right, const int32_t *bottom,
+        unsigned int count, int x, int y, int32_t *x_dist, int32_t *y_dist)
+{
+    if (count >= 8)
+    {
+        if (Cpu::HasAvx2())
+            return SplashAxisDistances_Avx2(left, top, right, bottom, count, x, y, x_dist, y_dist);
+        if (Cpu::HasSse2())
+            return SplashAxisDistances_Sse2(left, top, right, bottom, count, x, y, x_dist, y_dist);
+    }
+    SplashAxisDistances_Scalar(left, top, right, bottom, 0, count, x, y, x_dist, y_dist);
+}
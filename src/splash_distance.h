@@ -0,0 +1,13 @@
+#ifndef SPLASH_DISTANCE_H
+#define SPLASH_DISTANCE_H
+
+#include "types.h"
+
+// Vectorized part of Bullet::Splash, picking the version the cpu supports.
+// For each i in [0, count), writes the distance from (x, y) to the box
+// [left[i], right[i]] x [top[i], bottom[i]] along x to x_dist[i] and along y to y_dist[i].
+// They are what GetSplashDistance passes to Distance(), and 0 if (x, y) is inside the box.
+void SplashAxisDistances(const int32_t *left, const int32_t *top, const int32_t *right, const int32_t *bottom,
+        unsigned int count, int x, int y, int32_t *x_dist, int32_t *y_dist);
+
+#endif // SPLASH_DISTANCE_H
@@ -3,6 +3,7 @@
 #include "resolution.h"
 #include <algorithm>
 #include <array>
+#include <unordered_map>
 #include "offsets.h"
 #include "unit.h"
 #include "image.h"
@@ -15,6 +16,8 @@
 #include "warn.h"
 #include "rng.h"
 #include "perfclock.h"
+#include "slab_allocator.h"
+#include "sprite_draw_order.h"
 
 #include "log.h"
 
@@ -27,16 +30,22 @@ uint32_t Sprite::count = 0;
 uint32_t Sprite::draw_order_limit = 0x22DD0; // 0x150 * 0x6a4 / 0x4 (that is whole unit array)
 Sprite **Sprite::draw_order = (Sprite **)bw::units.raw_pointer();
 int Sprite::draw_order_amount;
+static SpriteDrawOrder draw_order_sorter;
+
+static SlabAllocator sprite_allocator("Sprite", sizeof(Sprite));
 
-#ifdef SYNC
 void *Sprite::operator new(size_t size)
 {
-    auto ret = new uint8_t[size];
+    auto ret = sprite_allocator.Allocate(size);
     if (SyncTest)
         ScrambleStruct(ret, size);
     return ret;
 }
-#endif
+
+void Sprite::operator delete(void *ptr)
+{
+    sprite_allocator.Free(ptr);
+}
 
 class SpriteIscriptContext : public Iscript::Context
 {
@@ -326,13 +335,7 @@ void Sprite::DeleteAll()
         draw_order_limit = 0x22DD0;
     }
     draw_order_amount = 0;
-}
-
-static bool SpritePtrCompare(Sprite *a, Sprite *b)
-{
-    if (a->sort_order == b->sort_order)
-        return a->id < b->id;
-    return a->sort_order < b->sort_order;
+    draw_order_sorter.Clear();
 }
 
 uint32_t Sprite::GetZCoord() const
@@ -361,6 +364,7 @@ void Sprite::CreateDrawSpriteList()
         vision_mask = *bw::replay_visions;
     else
         vision_mask = *bw::player_visions;
+    uint32_t view = first_y | (last_y << 8) | (vision_mask << 16);
 
     draw_order_amount = 0;
     while (first_y <= last_y)
@@ -376,7 +380,7 @@ void Sprite::CreateDrawSpriteList()
         }
         first_y++;
     }
-    std::sort(draw_order, draw_order + draw_order_amount, SpritePtrCompare);
+    draw_order_sorter.Sort(draw_order, draw_order_amount, view);
 }
 
 void Sprite::CreateDrawSpriteListFullRedraw()
@@ -396,6 +400,7 @@ void Sprite::CreateDrawSpriteListFullRedraw()
         vision_mask = *bw::replay_visions;
     else
         vision_mask = *bw::player_visions;
+    uint32_t view = first_y | (last_y << 8) | (vision_mask << 16);
 
     draw_order_amount = 0;
     while (first_y <= last_y)
@@ -410,7 +415,7 @@ void Sprite::CreateDrawSpriteListFullRedraw()
         }
         first_y++;
     }
-    std::sort(draw_order, draw_order + draw_order_amount, SpritePtrCompare);
+    draw_order_sorter.Sort(draw_order, draw_order_amount, view);
 }
 
 void Sprite::DrawSprites()
@@ -422,6 +427,33 @@ void Sprite::DrawSprites()
         perf_log->Log("DrawSprites %f ms\n", time);
 }
 
+// GetAreaVisibility results during LoneSpriteSystem::ProgressFrames, keyed by the tile area.
+// Lone sprites don't change map_tile_flags, so the sprites covering same tiles (which the
+// effects of a large fight usually are) can share the result.
+static std::unordered_map<uint64_t, uint8_t> area_visibility_cache;
+static bool area_visibility_cache_active = false;
+static int area_visibility_cache_hits = 0;
+
+static uint8_t CachedAreaVisibility(int x_tile, int y_tile, int w_tile, int h_tile)
+{
+    if (!area_visibility_cache_active)
+        return GetAreaVisibility(x_tile, y_tile, w_tile, h_tile);
+
+    uint64_t key = (uint64_t)(uint16_t)x_tile | (uint64_t)(uint16_t)y_tile << 16 |
+        (uint64_t)(uint16_t)w_tile << 32 | (uint64_t)(uint16_t)h_tile << 48;
+    auto it = area_visibility_cache.find(key);
+    if (it != area_visibility_cache.end())
+    {
+        if (Debug)
+            Assert(it->second == GetAreaVisibility(x_tile, y_tile, w_tile, h_tile));
+        area_visibility_cache_hits++;
+        return it->second;
+    }
+    uint8_t visibility = GetAreaVisibility(x_tile, y_tile, w_tile, h_tile);
+    area_visibility_cache.emplace(key, visibility);
+    return visibility;
+}
+
 void Sprite::UpdateVisibilityArea()
 {
     if (IsHidden())
@@ -450,7 +482,7 @@ void Sprite::UpdateVisibilityArea()
     if (y_tile + h_tile > map_height && map_height <= y_tile)
         return;
 
-    uint8_t visibility = GetAreaVisibility(x_tile, y_tile, w_tile, h_tile);
+    uint8_t visibility = CachedAreaVisibility(x_tile, y_tile, w_tile, h_tile);
     if (visibility != visibility_mask)
         SetVisibility(this, visibility);
 
@@ -538,6 +570,9 @@ static bool ProgressFowSpriteFrame(Sprite *sprite)
 
 void LoneSpriteSystem::ProgressFrames()
 {
+    area_visibility_cache.clear();
+    area_visibility_cache_hits = 0;
+    area_visibility_cache_active = true;
     for (auto entry : lone_sprites.Entries())
     {
         if (ProgressLoneSpriteFrame(entry->get()) == true)
@@ -546,6 +581,9 @@ void LoneSpriteSystem::ProgressFrames()
             entry.swap_erase();
         }
     }
+    area_visibility_cache_active = false;
+    perf_log->Log("Lone sprites: %d visibility areas, %d cached lookups\n",
+                 (int)area_visibility_cache.size(), area_visibility_cache_hits);
     for (auto entry : fow_sprites.Entries())
     {
         if (ProgressFowSpriteFrame(entry->get()) == true)
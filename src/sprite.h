@@ -108,10 +108,10 @@ class Sprite
         void RemoveSelectionOverlays();
         static int DrawnSprites() { return draw_order_amount; }
 
+        void operator delete(void *ptr);
+
     private:
-#ifdef SYNC
         void *operator new(size_t size);
-#endif
         Sprite();
 
         /// Initializes the sprite, returns false if unable and nothing was changed.
@@ -0,0 +1,127 @@
+#include "sprite_draw_order.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include "sprite.h"
+#include "perfclock.h"
+#include "console/assert.h"
+
+void SpriteDrawOrder::Clear()
+{
+    prev_sprites.clear();
+    prev_keys.clear();
+    prev_order.clear();
+    prev_view = 0;
+}
+
+bool SpriteDrawOrder::SameSprites(Sprite **sprites, uint32_t count, uint32_t view) const
+{
+    if (view != prev_view || count != prev_sprites.size())
+        return false;
+    // A deleted sprite's memory may have been reused for a new one, so the ids have to be compared as well
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (sprites[i] != prev_sprites[i] || (uint32_t)keys[i] != (uint32_t)prev_keys[i])
+            return false;
+    }
+    return true;
+}
+
+bool SpriteDrawOrder::ReusePreviousOrder(uint32_t count)
+{
+    order.clear();
+    changed.clear();
+    for (uint32_t pos : prev_order)
+    {
+        if (keys[pos] == prev_keys[pos])
+            order.emplace_back(pos);
+        else
+            changed.emplace_back(pos);
+    }
+    if (changed.empty())
+        return true;
+    // Sorting everything is cheaper at some point
+    if (changed.size() > count / 4)
+        return false;
+
+    auto compare = [this](uint32_t a, uint32_t b) { return keys[a] < keys[b]; };
+    std::sort(changed.begin(), changed.end(), compare);
+    prev_order.resize(count);
+    std::merge(order.begin(), order.end(), changed.begin(), changed.end(), prev_order.begin(), compare);
+    std::swap(order, prev_order);
+    return true;
+}
+
+void SpriteDrawOrder::RadixSort(uint32_t count)
+{
+    entries.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+        entries[i] = { keys[i], i };
+    if (count < 64)
+    {
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+            return a.key < b.key;
+        });
+    }
+    else
+    {
+        const int passes = 8;
+        uint32_t counts[passes][256];
+        memset(counts, 0, sizeof counts);
+        for (const Entry &entry : entries)
+        {
+            for (int pass = 0; pass < passes; pass++)
+                counts[pass][(entry.key >> (pass * 8)) & 0xff]++;
+        }
+
+        entries_tmp.resize(count);
+        Entry *src = entries.data(), *dest = entries_tmp.data();
+        for (int pass = 0; pass < passes; pass++)
+        {
+            // Usually only a few bytes of the id and sort_order differ between sprites
+            if (counts[pass][(src[0].key >> (pass * 8)) & 0xff] == count)
+                continue;
+            uint32_t offset = 0;
+            for (uint32_t &digit_count : counts[pass])
+            {
+                uint32_t next = offset + digit_count;
+                digit_count = offset;
+                offset = next;
+            }
+            for (uint32_t i = 0; i < count; i++)
+                dest[counts[pass][(src[i].key >> (pass * 8)) & 0xff]++] = src[i];
+            std::swap(src, dest);
+        }
+        if (src != entries.data())
+            std::copy(src, src + count, entries.data());
+    }
+
+    order.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+        order[i] = entries[i].index;
+}
+
+void SpriteDrawOrder::Sort(Sprite **sprites, uint32_t count, uint32_t view)
+{
+    STATIC_PERF_CLOCK(Sprite_SortDrawOrder);
+    keys.resize(count);
+    for (uint32_t i = 0; i < count; i++)
+        keys[i] = ((uint64_t)sprites[i]->sort_order << 32) | sprites[i]->id;
+
+    if (!SameSprites(sprites, count, view) || !ReusePreviousOrder(count))
+        RadixSort(count);
+
+    prev_sprites.assign(sprites, sprites + count);
+    for (uint32_t i = 0; i < count; i++)
+        sprites[i] = prev_sprites[order[i]];
+    if (Debug)
+    {
+        for (uint32_t i = 1; i < count; i++)
+            Assert(keys[order[i - 1]] < keys[order[i]]);
+    }
+
+    std::swap(prev_keys, keys);
+    std::swap(prev_order, order);
+    prev_view = view;
+}
@@ -0,0 +1,48 @@
+#ifndef SPRITE_DRAW_ORDER_H
+#define SPRITE_DRAW_ORDER_H
+
+#include "types.h"
+
+// Sorts the sprites of Sprite::draw_order by (sort_order, id).
+// If the sprites in view are the same as on the previous call, the previous order
+// is reused and only the sprites whose sort_order has changed are sorted again.
+// Otherwise the sprites are radix sorted. As ids are unique, the result is always
+// the one std::sort would give.
+class SpriteDrawOrder
+{
+    public:
+        SpriteDrawOrder() : prev_view(0) {}
+
+        // Sprites are expected in the order they were collected from the horizontal sprite lines,
+        // with sort_order already set. View identifies the lines and vision mask they were collected with.
+        void Sort(Sprite **sprites, uint32_t count, uint32_t view);
+        // Must be called when sprites are deleted without Sort being called afterwards
+        // (e.g. when a game ends), as ids get reused.
+        void Clear();
+
+    private:
+        struct Entry
+        {
+            uint64_t key;
+            uint32_t index;
+        };
+
+        bool SameSprites(Sprite **sprites, uint32_t count, uint32_t view) const;
+        bool ReusePreviousOrder(uint32_t count);
+        void RadixSort(uint32_t count);
+
+        // Indexed by the position in sprites
+        vector<uint64_t> keys;
+        // Positions in sprites, sorted
+        vector<uint32_t> order;
+        vector<Sprite *> prev_sprites;
+        vector<uint64_t> prev_keys;
+        vector<uint32_t> prev_order;
+        uint32_t prev_view;
+
+        vector<Entry> entries;
+        vector<Entry> entries_tmp;
+        vector<uint32_t> changed;
+};
+
+#endif // SPRITE_DRAW_ORDER_H
@@ -7,6 +7,7 @@
 #include "pathing.h"
 #include "sprite.h"
 #include "ai.h"
+#include "log.h"
 
 #include <algorithm>
 
@@ -17,6 +17,14 @@
 #include "ai.h"
 #include "ai_hit_reactions.h"
 #include "triggers.h"
+#include "scthread.h"
+#include "frame_graph.h"
+#include "game.h"
+#include "sync.h"
+#include "grp_blit.h"
+#include "fog.h"
+#include "cpu.h"
+#include "init.h"
 
 #include "possearch.hpp"
 
@@ -1262,6 +1270,433 @@ struct Test_PosSearch : public GameTest {
     }
 };
 
+struct Test_ParallelReduce : public GameTest {
+    vector<Unit *> units;
+    void Init() override {
+    }
+    static uint32_t UnitHash(uint32_t pos, Unit *unit) {
+        return (pos + 1) * (unit->lookup_id ^ (unit->sprite->position.x << 16) ^ unit->sprite->position.y);
+    }
+    void NextFrame() override {
+        switch (state) {
+            case 0: {
+                for (int i = 0; i < 97; i++)
+                    CreateUnitForTestAt(Unit::Marine, 0, Point(100 + (i % 10) * 20, 100 + (i / 10) * 20));
+                state++;
+            } break; case 1: {
+                for (Unit *unit : *bw::first_active_unit)
+                    units.emplace_back(unit);
+                // Both the chunk results and their folding are order-sensitive, so a result
+                // combined out of order would not match
+                auto chunk_hash = [&](uint32_t begin, uint32_t end) {
+                    uint32_t hash = 0;
+                    for (uint32_t i = begin; i < end; i++)
+                        hash = hash * 31 + UnitHash(i, units[i]);
+                    return hash;
+                };
+                auto combine = [](uint32_t a, uint32_t b) { return a * 31 + b; };
+                for (uint32_t grain : { 1, 2, 7, 32, 96, 97, 1000 }) {
+                    uint32_t serial = 0;
+                    for (uint32_t begin = 0; begin < units.size(); begin += grain)
+                        serial = combine(serial, chunk_hash(begin, std::min(begin + grain, (uint32_t)units.size())));
+                    for (uint32_t helpers : { 0u, 1u, 2u, 3u, UINT32_MAX }) {
+                        uint32_t result = ParallelReduce(0, units.size(), grain, 0u, [&](ScThreadVars *vars, uint32_t begin, uint32_t end) {
+                            uint32_t *scratch = vars->unit_search_pool.Allocate<uint32_t>(end - begin);
+                            for (uint32_t i = begin; i < end; i++)
+                                scratch[i - begin] = UnitHash(i, units[i]);
+                            uint32_t hash = 0;
+                            for (uint32_t i = begin; i < end; i++)
+                                hash = hash * 31 + scratch[i - begin];
+                            return hash;
+                        }, combine, helpers);
+                        TestAssert(result == serial);
+
+                        vector<uint32_t> hashes;
+                        hashes.resize(units.size());
+                        ParallelFor(0, units.size(), grain, [&](ScThreadVars *vars, uint32_t begin, uint32_t end) {
+                            for (uint32_t i = begin; i < end; i++)
+                                hashes[i] = UnitHash(i, units[i]);
+                        }, helpers);
+                        for (uint32_t i = 0; i < units.size(); i++)
+                            TestAssert(hashes[i] == UnitHash(i, units[i]));
+                    }
+                }
+                uint32_t empty = ParallelReduce(5, 5, 3, 1234u, [&](ScThreadVars *vars, uint32_t begin, uint32_t end) {
+                    return 0u;
+                }, [](uint32_t a, uint32_t b) { return a + b; });
+                TestAssert(empty == 1234);
+                // Tiny chunks finish before most helpers get to run, and the helpers that
+                // ClearAll discards still have to release the job's state
+                for (int i = 0; i < 100; i++) {
+                    ParallelFor(0, 64, 1, [](ScThreadVars *vars, uint32_t begin, uint32_t end) {
+                    });
+                    threads->ClearAll();
+                    TestAssert(ParallelJob::LiveStateCount() == 0);
+                }
+                Pass();
+            }
+        }
+    }
+};
+
+// Runs the same frames with serial and parallel frame phases, and compares the sync hashes.
+// The trigger hash (and thus the main hash) depends on the frame count, so it is left out.
+struct Test_FrameGraphSync : public GameTest {
+    static const int Frames = 300;
+    bool was_parallel;
+    int round;
+    int frame;
+    vector<uint32_t> hashes[2];
+    void Init() override {
+        was_parallel = parallel_frame_phases;
+        round = 0;
+        frame = 0;
+        NoAi();
+        Visions();
+    }
+    void Done() override {
+        parallel_frame_phases = was_parallel;
+        ResetVisions();
+    }
+    void StartRound() {
+        parallel_frame_phases = round == 1;
+        *bw::rng_seed = 1234;
+        *bw::vision_update_count = 50;
+        *bw::order_wait_reassign = 150;
+        *bw::secondary_order_wait_reassign = 300;
+        for (int i = 0; i < 40; i++) {
+            Unit *unit = CreateUnitForTestAt(i & 1 ? Unit::Zergling : Unit::Wraith, 0, Point(200 + (i % 8) * 30, 200 + (i / 8) * 30));
+            IssueOrderTargetingGround(unit, Order::Move, 600 - (i % 8) * 30, 500 - (i / 8) * 30);
+        }
+    }
+    void NextFrame() override {
+        switch (state) {
+            case 0: {
+                StartRound();
+                frame = 0;
+                state++;
+            } break; case 1: {
+                auto sync = GetSyncHashes();
+                hashes[round].emplace_back(sync.units_hash);
+                hashes[round].emplace_back(sync.unit_sprites_hash);
+                hashes[round].emplace_back(sync.bullets_hash ^ sync.bullet_sprites_hash);
+                hashes[round].emplace_back(sync.paths_hash);
+                hashes[round].emplace_back(sync.ai_region_hash ^ sync.ai_hash);
+                if (++frame == Frames) {
+                    ClearUnits();
+                    state++;
+                }
+            } break; case 2: {
+                if (*bw::first_active_unit == nullptr && *bw::first_dying_unit == nullptr) {
+                    if (round == 0) {
+                        round = 1;
+                        state = 0;
+                    } else {
+                        TestAssert(hashes[0] == hashes[1]);
+                        Pass();
+                    }
+                }
+            }
+        }
+    }
+};
+
+struct Test_UnitSearchGrid : public GameTest {
+    vector<Unit *> units;
+    bool was_enabled;
+    void Init() override {
+        was_enabled = unit_search->IsGridEnabled();
+        unit_search->SetGridEnabled(true);
+    }
+    void Done() override {
+        unit_search->SetGridEnabled(was_enabled);
+    }
+    static vector<Unit *> Results(Unit **units) {
+        vector<Unit *> result;
+        while (*units != nullptr)
+            result.emplace_back(*units++);
+        return result;
+    }
+    bool Compare(const Rect16 &rect) {
+        vector<Unit *> results[2][2];
+        Unit *nearest[2];
+        Point center((rect.left + rect.right) / 2, (rect.top + rect.bottom) / 2);
+        for (int grid = 0; grid < 2; grid++) {
+            unit_search->SetGridEnabled(grid == 1);
+            results[grid][0] = Results(unit_search->FindUnitsRect(rect));
+            unit_search->PopResult();
+            results[grid][1] = Results(unit_search->FindUnitBordersRect(&rect));
+            unit_search->PopResult();
+            nearest[grid] = unit_search->FindNearest(center, rect, [](const auto *a) { return true; });
+        }
+        unit_search->SetGridEnabled(true);
+        return results[0][0] == results[1][0] && results[0][1] == results[1][1] && nearest[0] == nearest[1];
+    }
+    void NextFrame() override {
+        switch (state) {
+            case 0: {
+                uint32_t seed = 1;
+                for (int i = 0; i < 80; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    Point pos(64 + (seed >> 8) % 900, 64 + (seed >> 20) % 700);
+                    int unit_id = i % 10 == 0 ? Unit::Ultralisk : i % 3 == 0 ? Unit::Wraith : Unit::Marine;
+                    units.emplace_back(CreateUnitForTestAt(unit_id, i & 1, pos));
+                }
+                CreateUnitForTestAt(Unit::CommandCenter, 0, Point(600, 400));
+                for (unsigned i = 0; i < units.size(); i++) {
+                    Point pos = units[(i * 7) % units.size()]->sprite->position;
+                    IssueOrderTargetingGround(units[i], Order::Move, pos.x, pos.y);
+                }
+                frames_remaining = 200;
+                state++;
+            } break; case 1: {
+                // Units move and collide with the grid enabled, which Debug builds also check
+                if (frames_remaining == 150) {
+                    for (unsigned i = 0; i < units.size(); i += 5)
+                        units[i]->Kill(nullptr);
+                }
+                if (frames_remaining < 100)
+                    state++;
+            } break; case 2: {
+                for (int x = 0; x < 1100; x += 70) {
+                    for (int y = 0; y < 900; y += 90) {
+                        TestAssert(Compare(Rect16(x, y, x + 1, y + 1)));
+                        TestAssert(Compare(Rect16(x, y, x + 40, y + 24)));
+                        TestAssert(Compare(Rect16(x, y, x + 300, y + 200)));
+                    }
+                }
+                TestAssert(Compare(MapBounds()));
+                Pass();
+            }
+        }
+    }
+};
+
+struct Test_UnitSearchKNearest : public GameTest {
+    vector<Unit *> units;
+    bool was_enabled;
+    void Init() override {
+        was_enabled = unit_search->IsGridEnabled();
+    }
+    void Done() override {
+        unit_search->SetGridEnabled(was_enabled);
+    }
+    template <class Func>
+    vector<Unit *> BruteForce(const Point &pos, const Rect16 &area, int k, Func IsValid) {
+        vector<Unit *> result;
+        for (Unit *unit : units) {
+            const auto &val_pos = unit->sprite->position;
+            if (val_pos.x >= area.left && val_pos.x < area.right && val_pos.y >= area.top && val_pos.y < area.bottom)
+                if (IsValid(unit))
+                    result.emplace_back(unit);
+        }
+        std::sort(result.begin(), result.end(), [&](const Unit *a, const Unit *b) {
+            int a_dist = Distance(pos, a->sprite->position), b_dist = Distance(pos, b->sprite->position);
+            return a_dist < b_dist || (a_dist == b_dist && a->search_left < b->search_left);
+        });
+        if ((int)result.size() > k)
+            result.resize(k);
+        return result;
+    }
+    template <class Func>
+    bool Compare(const Point &pos, const Rect16 &area, int k, Func IsValid) {
+        Rect16 map = MapBounds();
+        bool whole_map = area.left == map.left && area.top == map.top && area.right == map.right &&
+            area.bottom == map.bottom;
+        auto expected = BruteForce(pos, area, k, IsValid);
+        for (int grid = 0; grid < 2; grid++) {
+            unit_search->SetGridEnabled(grid == 1);
+            Unit *out[MainUnitSearch::MaxKNearest];
+            int count = unit_search->FindKNearest(pos, area, k, out, IsValid);
+            if (count != (int)expected.size() || !std::equal(out, out + count, expected.begin()))
+                return false;
+            // FindNearest checks the area only partially, and may pick another unit at the same distance
+            if (k == 1 && whole_map) {
+                Unit *nearest = unit_search->FindNearest(pos, area, IsValid);
+                if ((nearest == nullptr) != (count == 0))
+                    return false;
+                if (nearest && Distance(pos, nearest->sprite->position) != Distance(pos, out[0]->sprite->position))
+                    return false;
+            }
+        }
+        return true;
+    }
+    void NextFrame() override {
+        switch (state) {
+            case 0: {
+                // A long vertical line, which is the worst case for the x-sorted arrays
+                for (int i = 0; i < 60; i++)
+                    units.emplace_back(CreateUnitForTestAt(Unit::Marine, i & 1, Point(300, 40 + i * 14)));
+                uint32_t seed = 7;
+                for (int i = 0; i < 20; i++) {
+                    seed = seed * 1103515245 + 12345;
+                    Point pos(64 + (seed >> 8) % 900, 64 + (seed >> 20) % 700);
+                    units.emplace_back(CreateUnitForTestAt(i & 1 ? Unit::Wraith : Unit::Ultralisk, 0, pos));
+                }
+                state++;
+            } break; case 1: {
+                auto All = [](const Unit *unit) { return true; };
+                auto Player1 = [](const Unit *unit) { return unit->player == 1; };
+                for (int x = 0; x < 1100; x += 110) {
+                    for (int y = 0; y < 900; y += 75) {
+                        Point pos(x, y);
+                        for (int k : { 1, 4, MainUnitSearch::MaxKNearest }) {
+                            TestAssert(Compare(pos, MapBounds(), k, All));
+                            TestAssert(Compare(pos, MapBounds(), k, Player1));
+                            TestAssert(Compare(pos, Rect16(x / 2, y / 2, x / 2 + 250, y / 2 + 300), k, All));
+                        }
+                    }
+                }
+                Pass();
+            }
+        }
+    }
+};
+
+struct Test_GrpBlit : public GameTest {
+    void Init() override {
+    }
+    void Done() override {
+        Cpu::DisableSimd(false);
+    }
+    // Compares the blitter the cpu supports against the scalar one
+    bool Compare(const uint8_t *line, int width, const uint8_t *table, const uint8_t *surface) {
+        GrpRemap remap(table);
+        for (int flipped = 0; flipped < 2; flipped++) {
+            uint8_t out[2][256];
+            const uint8_t *in = flipped ? line + width - 1 : line;
+            for (int simd = 0; simd < 2; simd++) {
+                Cpu::DisableSimd(simd == 0);
+                std::copy(surface, surface + width, out[simd]);
+                GetGrpLineBlitter(flipped == 1, remap)(in, out[simd], width, &remap);
+            }
+            Cpu::DisableSimd(false);
+            for (int i = 0; i < width; i++) {
+                uint8_t color = flipped ? in[-i] : in[i];
+                if (out[0][i] != (color ? table[color] : surface[i]) || out[1][i] != out[0][i])
+                    return false;
+            }
+        }
+        return true;
+    }
+    bool CompareBlend(const uint8_t *line, int width, const uint8_t *blend_table, const uint8_t *surface) {
+        for (int flipped = 0; flipped < 2; flipped++) {
+            uint8_t out[2][256];
+            const uint8_t *in = flipped ? line + width - 1 : line;
+            for (int simd = 0; simd < 2; simd++) {
+                Cpu::DisableSimd(simd == 0);
+                std::copy(surface, surface + width, out[simd]);
+                GetGrpBlendLineBlitter(flipped == 1, blend_table)(in, out[simd], width, blend_table);
+            }
+            Cpu::DisableSimd(false);
+            for (int i = 0; i < width; i++) {
+                uint8_t color = flipped ? in[-i] : in[i];
+                if (out[0][i] != blend_table[color << 8 | surface[i]] || out[1][i] != out[0][i])
+                    return false;
+            }
+        }
+        return true;
+    }
+    void NextFrame() override {
+        uint32_t seed = 3;
+        auto Random = [&]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+        // Grp lines have padding on both sides, which the blitters may read
+        uint8_t line[grp_padding_size + 256 + grp_padding_size];
+        uint8_t surface[256];
+        uint8_t table[256];
+        for (int test = 0; test < 300; test++) {
+            for (int i = 0; i < 256; i++)
+                table[i] = i;
+            // Identity, player colors only, and a table which can only be used as a table
+            if (test % 3 == 1) {
+                for (int i = 8; i < 16; i++)
+                    table[i] = Random();
+            } else if (test % 3 == 2) {
+                for (int i = 0; i < 256; i++)
+                    table[i] = Random();
+            }
+            for (auto &color : line)
+                color = Random() % 3 == 0 ? 0 : Random() & 1 ? 8 + Random() % 8 : Random();
+            for (auto &color : surface)
+                color = Random();
+            int width = grp_padding_size * (1 + test % 16);
+            TestAssert(Compare(line + grp_padding_size, width, table, surface));
+        }
+        vector<uint8_t> blend_table;
+        blend_table.resize(0x10000);
+        for (int test = 0; test < 100; test++) {
+            for (auto &color : blend_table)
+                color = Random();
+            // Usually color 0 keeps the surface color, which allows skipping transparent pixels
+            if (test % 4 != 0) {
+                for (int i = 0; i < 256; i++)
+                    blend_table[i] = i;
+            }
+            for (auto &color : line)
+                color = Random() & 1 ? 0 : Random();
+            if (test % 3 == 0)
+                std::fill(line + grp_padding_size, line + grp_padding_size * 3, 0);
+            for (auto &color : surface)
+                color = Random();
+            int width = grp_padding_size * (1 + test % 16);
+            TestAssert(CompareBlend(line + grp_padding_size, width, blend_table.data(), surface));
+        }
+        Pass();
+    }
+};
+
+struct Test_Fog : public GameTest {
+    void Init() override {
+    }
+    void Done() override {
+        Cpu::DisableSimd(false);
+    }
+    void NextFrame() override {
+        uint32_t seed = 5;
+        auto Random = [&]() { seed = seed * 1103515245 + 12345; return seed >> 16; };
+        uint32_t flags[fog_width * fog_height];
+        uint8_t fog[2][fog_width * fog_height];
+        uint8_t blurred[2][fog_width * fog_height];
+        for (int test = 0; test < 100; test++) {
+            for (auto &tile : flags) {
+                tile = Random() << 16 | Random();
+                if (Random() & 1)
+                    tile |= 0xffff;
+            }
+            FogRule rule;
+            rule.full_value = Random();
+            rule.half_value = rule.full_value / 2;
+            rule.zero_test = { test & 1 ? 0xff00 : Random() & 0xff, (test & 2) != 0 };
+            rule.half_test = { test & 1 ? 0xff : Random() & 0xff, (test & 2) != 0 };
+            for (int simd = 0; simd < 2; simd++) {
+                Cpu::DisableSimd(simd == 0);
+                for (int i = 0; i < fog_height; i++)
+                    ClassifyFogLine(flags + i * fog_width, fog_width, rule, fog[simd] + i * fog_width);
+                std::fill(blurred[simd], blurred[simd] + fog_width * fog_height, 0xcc);
+                BlurFog(fog[simd], blurred[simd], fog_width, fog_height);
+            }
+            Cpu::DisableSimd(false);
+            for (int i = 0; i < fog_width * fog_height; i++) {
+                TestAssert(fog[0][i] == rule.Value(flags[i]));
+                TestAssert(fog[1][i] == fog[0][i]);
+                TestAssert(blurred[1][i] == blurred[0][i]);
+            }
+        }
+        Pass();
+    }
+};
+
+struct Test_GrpDecoding : public GameTest {
+    void Init() override {
+    }
+    void NextFrame() override {
+        TestAssert(TestDeferredGrpDecoding("unit\\terran\\marine.grp"));
+        TestAssert(TestDeferredGrpDecoding("unit\\zerg\\ultra.grp"));
+        TestAssert(TestDeferredGrpDecoding("unit\\protoss\\pbattle.grp"));
+        Pass();
+    }
+};
+
 struct Test_AiTarget : public GameTest {
     Unit *unit;
     Unit *enemy;
@@ -2051,6 +2486,13 @@ GameTests::GameTests()
     AddTest("Ai aggro", new Test_AiAggro);
     AddTest("Mind control", new Test_MindControl);
     AddTest("Pos search", new Test_PosSearch);
+    AddTest("Parallel reduce", new Test_ParallelReduce);
+    AddTest("Frame graph sync", new Test_FrameGraphSync);
+    AddTest("Unit search grid", new Test_UnitSearchGrid);
+    AddTest("Unit search k nearest", new Test_UnitSearchKNearest);
+    AddTest("Grp blitters", new Test_GrpBlit);
+    AddTest("Fog generation", new Test_Fog);
+    AddTest("Deferred grp decoding", new Test_GrpDecoding);
     AddTest("Ai targeting", new Test_AiTarget);
     AddTest("Attack move", new Test_AttackMove);
     AddTest("Detection", new Test_Detection);
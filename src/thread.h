@@ -6,7 +6,7 @@
 #include <thread>
 #include <condition_variable>
 #include "console/windows_wrap.h"
-#include "common/ll-deque.h"
+#include "common/ws-deque.h"
 #include "types.h"
 
 template <typename Tvar> class ThreadPool;
@@ -19,13 +19,20 @@ class Task
     public:
         Task() { }
         Task(const volatile Task<Tvar> &other) { *this = other; }
-        Task(void (*a)(Tvar *, void *), void *b) { func = a; param = b; }
-        void operator=(const Task &other) { func = other.func; param = other.param; }
-        void operator=(const Task &other) volatile { func = other.func; param = other.param; }
-        void operator=(const volatile Task &other) volatile { func = other.func; param = other.param; }
+        Task(void (*a)(Tvar *, void *), void *b, void (*c)(void *)) { func = a; param = b; cancel = c; }
+        void operator=(const Task &other) { func = other.func; param = other.param; cancel = other.cancel; }
+        void operator=(const Task &other) volatile { func = other.func; param = other.param; cancel = other.cancel; }
+        void operator=(const volatile Task &other) volatile
+        {
+            func = other.func;
+            param = other.param;
+            cancel = other.cancel;
+        }
 
         void (*func)(Tvar *, void *);
         void *param;
+        // Called instead of func if the task gets discarded, may be nullptr
+        void (*cancel)(void *);
 };
 
 template <typename Tvar>
@@ -80,9 +87,11 @@ class PoolThread : public Thread<Tvar>
         {
             should_sleep.store(false, std::memory_order_relaxed);
         }
-        void Init(ThreadPool<Tvar> *pool)
+        void Init(ThreadPool<Tvar> *pool_, int index_)
         {
             next_free = nullptr;
+            pool = pool_;
+            index = index_;
             Thread<Tvar>::Init(pool, &PoolThreadProc);
         }
         ~PoolThread() {}
@@ -107,6 +116,7 @@ class PoolThread : public Thread<Tvar>
             PoolThread<Tvar> *thread = (PoolThread<Tvar> *)params->thread;
             thread->thread_variables = params->vars;
             delete params;
+            TlsSetValue(pool->current_thread_tls, thread);
 
             while (true)
             {
@@ -129,19 +139,30 @@ class PoolThread : public Thread<Tvar>
     public:
         std::atomic<bool> should_sleep;
         PoolThread *next_free;
+        ThreadPool<Tvar> *pool;
+        int index;
+        // Tasks added by this thread, other threads steal from the top
+        Common::WorkStealingDeque<Task<Tvar>> tasks;
 };
 
 template <typename Tvar>
 class ThreadPool
 {
+    friend class PoolThread<Tvar>;
     public:
         ThreadPool()
         {
             state.store(0, std::memory_order_relaxed);
             sleep_count.store(0, std::memory_order_relaxed);
+            steal_count.store(0, std::memory_order_relaxed);
             free_threads.store(nullptr, std::memory_order_relaxed);
+            inject_lock.clear(std::memory_order_relaxed);
+            wake_lock.clear(std::memory_order_relaxed);
+            // Not thread_local, as implicit tls does not work in dlls loaded with
+            // LoadLibrary on older windows versions
+            current_thread_tls = TlsAlloc();
         }
-        ThreadPool(int size)
+        ThreadPool(int size) : ThreadPool()
         {
             Init(size);
         }
@@ -152,19 +173,26 @@ class ThreadPool
             {
                 threads.emplace_back(new PoolThread<Tvar>);
             }
-            for (auto &thread : threads)
+            for (int i = 0; i < size; i++)
             {
-                thread->Init(this);
+                threads[i]->Init(this, i);
             }
         }
         ~ThreadPool() {}
 
         int GetThreadCount() { return threads.size(); }
 
+        // The worker of this pool running on the calling thread, or nullptr if called from elsewhere
+        PoolThread<Tvar> *CurrentThread() const
+        {
+            return (PoolThread<Tvar> *)TlsGetValue(current_thread_tls);
+        }
+
+        // Discards all queued tasks, calling their cancel functions, and waits until every worker is idle.
+        // Tasks are not allowed to be added from other threads while this is being called.
         void ClearAll()
         {
-            Task<Tvar> tmp;
-            tasks.clear();
+            DiscardQueued();
             for (auto &thread : threads)
             {
                 thread->should_sleep.store(true, std::memory_order_relaxed);
@@ -174,56 +202,77 @@ class ThreadPool
                 while (thread->IsRunning())
                 {
                     Sleep(0);
+                    // A running task may have queued more work
+                    DiscardQueued();
                     // The first should_sleep may get overwritten if thread had just awaken
                     thread->should_sleep.store(true, std::memory_order_relaxed);
                 }
             }
         }
 
-        // Ironically, this function can only be called from one thread at time
+        // Can be called from any thread. Worker threads push to their own deque,
+        // others go through the shared injection deque.
+        // If the task is discarded by ClearAll before it gets to run, cancel(param) is called instead.
         template <typename Param>
-        void AddTask(void (*func)(Tvar *, Param *), Param *param)
+        void AddTask(void (*func)(Tvar *, Param *), Param *param, void (*cancel)(Param *) = nullptr)
         {
             auto old_state = state.load(std::memory_order_acquire);
-            tasks.push_back(Task<Tvar>((void (*)(Tvar *, void *))func, param));
-            while (true)
+            Task<Tvar> task((void (*)(Tvar *, void *))func, param, (void (*)(void *))cancel);
+            PoolThread<Tvar> *self = CurrentThread();
+            if (self != nullptr)
+            {
+                self->tasks.push_back(task);
+            }
+            else
             {
-                PoolThread<Tvar> *thread = free_threads.load(std::memory_order_acquire);
-                if (thread == ThreadsBusy)
+                while (inject_lock.test_and_set(std::memory_order_acquire))
+                    ;
+                injected_tasks.push_back(task);
+                inject_lock.clear(std::memory_order_release);
+            }
+
+            PoolThread<Tvar> *thread = free_threads.load(std::memory_order_acquire);
+            if (thread == ThreadsBusy)
+            {
+                // Return if no workers have gone sleep during this
+                if (state.compare_exchange_strong(old_state, old_state + 1,
+                        std::memory_order_release, std::memory_order_relaxed) == true)
                 {
-                    // Return if no workers have gone sleep during this
-                    if (state.compare_exchange_strong(old_state, old_state + 1,
-                            std::memory_order_release, std::memory_order_relaxed) == true)
-                    {
-                        return;
-                    }
-                    // However, the sleeping thread might not have yet added itself to the free_threads list
-                    while (thread == ThreadsBusy)
-                        thread = free_threads.load(std::memory_order_acquire);
+                    return;
                 }
-                // Now there is at least one sleeping thread, fight until we get one of them
-                while (true)
+                // However, the sleeping thread might not have yet added itself to the free_threads list
+                while (thread == ThreadsBusy)
+                    thread = free_threads.load(std::memory_order_acquire);
+            }
+            // Now there is at least one sleeping thread, fight until we get one of them.
+            // Only one thread pops at time, as otherwise the list would be prone to ABA
+            while (wake_lock.test_and_set(std::memory_order_acquire))
+                ;
+            thread = free_threads.load(std::memory_order_acquire);
+            while (thread != ThreadsBusy)
+            {
+                if (free_threads.compare_exchange_weak(thread, thread->next_free,
+                        std::memory_order_release, std::memory_order_acquire) == true)
                 {
-                    if (free_threads.compare_exchange_strong(thread, thread->next_free,
-                            std::memory_order_release, std::memory_order_relaxed) == true)
-                    {
-                        thread->Wake();
-                        return;
-                    }
+                    break;
                 }
             }
+            wake_lock.clear(std::memory_order_release);
+            // Someone else may have woken everyone already, which is fine as
+            // the task has been queued before
+            if (thread != ThreadsBusy)
+                thread->Wake();
         }
 
         bool RequestTask(PoolThread<Tvar> *thread)
         {
-            Task<Tvar> task;
             auto old_state = state.load(std::memory_order_acquire);
             while (true)
             {
                 int spincount = 1000;
                 while (spincount--)
                 {
-                    if (tasks.pop_front(&thread->task)) // Success
+                    if (thread->tasks.pop_back(&thread->task) || Steal(thread, &thread->task)) // Success
                     {
                         return true;
                     }
@@ -255,14 +304,62 @@ class ThreadPool
 
         // Can be used to tell how many sleep calls have occured
         int GetSleepCount() { return sleep_count.load(std::memory_order_relaxed); }
+        // And how many tasks were taken from another thread's deque
+        int GetStealCount() { return steal_count.load(std::memory_order_relaxed); }
 
     private:
+        // The injected tasks are checked first, so tasks from main thread
+        // keep being executed roughly in order they were added
+        bool Steal(PoolThread<Tvar> *thread, Task<Tvar> *out)
+        {
+            if (injected_tasks.steal(out))
+                return true;
+            int count = threads.size();
+            for (int i = 1; i < count; i++)
+            {
+                int pos = thread->index + i;
+                if (pos >= count)
+                    pos -= count;
+                if (threads[pos]->tasks.steal(out))
+                {
+                    if (PerfTest)
+                        steal_count.fetch_add(1, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void DiscardQueued()
+        {
+            Task<Tvar> tmp;
+            while (!injected_tasks.empty())
+            {
+                if (injected_tasks.steal(&tmp) && tmp.cancel != nullptr)
+                    tmp.cancel(tmp.param);
+            }
+            for (auto &thread : threads)
+            {
+                while (!thread->tasks.empty())
+                {
+                    if (thread->tasks.steal(&tmp) && tmp.cancel != nullptr)
+                        tmp.cancel(tmp.param);
+                }
+            }
+        }
+
         std::atomic<unsigned int> sleep_count;
+        std::atomic<unsigned int> steal_count;
         std::vector<ptr<PoolThread<Tvar>>> threads;
-        Common::LocklessQueue<Task<Tvar>> tasks;
+        // Tasks added by threads outside the pool, pushes are serialized with inject_lock
+        Common::WorkStealingDeque<Task<Tvar>> injected_tasks;
+        std::atomic_flag inject_lock;
+        std::atomic_flag wake_lock;
 
         std::atomic<PoolThread<Tvar> *> free_threads; // linked list head
         std::atomic<unsigned int> state;
+        // Set by PoolThreadProc to the worker running on the thread
+        DWORD current_thread_tls;
         static constexpr PoolThread<Tvar> *const ThreadsBusy = (PoolThread<Tvar> *)0x0;
 };
 
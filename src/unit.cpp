@@ -34,6 +34,7 @@
 #include "strings.h"
 #include "unit_cache.h"
 #include "entity.h"
+#include "sight_reveal.h"
 
 using std::get;
 using std::max;
@@ -50,6 +51,7 @@ vector<Unit *> Unit::temp_flagged;
 const int UNIT_ID_LOOKUP_SIZE = 0x2000;
 
 bool late_unit_frames_in_progress = false;
+static SightRevealer sight_revealer;
 
 #ifdef SYNC
 void *Unit::operator new(size_t size)
@@ -135,6 +137,8 @@ Unit::Unit()
     kills = 0;
     ground_strength = 0;
     air_strength = 0;
+    collision_pair_sweep = 0;
+    collision_pair_changed = 0;
 
     lookup_id = next_id++;
     while (lookup_id == 0 || FindById(lookup_id) != 0)
@@ -883,7 +887,7 @@ void Unit::ProgressActiveUnitFrame()
     }
 
     if (*bw::reveal_unit_area || (flyers && *bw::vision_updated))
-        RevealSightArea(this);
+        sight_revealer.Reveal(this);
     if (HasSubunit() && flags & UnitStatus::Completed)
     {
         int rotation = movement_direction - old_direction;
@@ -1070,6 +1074,8 @@ ProgressUnitResults Unit::ProgressFrames()
     StaticPerfClock::ClearWithLog("Unit::ProgressFrames");
     PerfClock klokki;
     ProgressUnitResults results;
+    // UpdateFog has been called before this, so the previous frame's reveals don't count
+    sight_revealer.Clear();
 
     *bw::ai_interceptor_target_switch = 0;
     ClearOrderTargetingIfNeeded();
@@ -1126,24 +1132,36 @@ ProgressUnitResults Unit::ProgressFrames()
     }
     first_movementstate_flyer.MergeTo(first_allocated_unit);
     unit_search->ChangeUnitPosition_Finish();
+    unit_search->SweepCollisionPairs();
 
     auto movement_time = klokki.GetTime();
+    int revealers = 0;
     if (vision_updated)
     {
         for (Unit *unit : *bw::first_revealer)
         {
-            RevealSightArea(unit);
+            sight_revealer.Reveal(unit);
+            revealers++;
         }
     }
+    auto reveal_time = klokki.GetTime();
+    // Splitting the fields read here to a separate hot array would not help much:
+    // UpdateVisibility and UpdateDetectionStatus are bw functions which read (and write)
+    // the Unit structure itself, so only flags and the timers would come from the array,
+    // and keeping it synced would require hooking every place bw writes them.
+    int active_units = 0, invisible_units = 0, detection_updates = 0;
     for (Unit *unit : *bw::first_active_unit)
     {
         UpdateVisibility(unit);
+        active_units++;
         if (unit->IsInvisible())
         {
+            invisible_units++;
             unit->invisibility_effects = 0;
             if (unit->secondary_order_wait == 0)
             {
                 UpdateDetectionStatus(unit);
+                detection_updates++;
                 unit->secondary_order_wait = 30;
             }
             else
@@ -1215,10 +1233,16 @@ ProgressUnitResults Unit::ProgressFrames()
 
     post_time -= active_frames_time;
     active_frames_time -= misc_time;
+    auto visibility_time = misc_time - reveal_time;
     misc_time -= movement_time;
+    reveal_time -= movement_time;
     movement_time -= pre_time;
     perf_log->Log("ProgressUnitFrames: Pre %f ms + Movement %f ms + Misc %f ms + Active main %f ms + post %f ms = about %f ms\n",
                  pre_time, movement_time, misc_time, active_frames_time, post_time, klokki.GetTime());
+    perf_log->Log("Misc: %d revealers %f ms + %d units (%d invisible, %d detection updates) %f ms\n",
+                 revealers, reveal_time, active_units, invisible_units, detection_updates, visibility_time);
+    perf_log->Log("Sight reveals: %d done, %d skipped as duplicates\n",
+                 sight_revealer.RevealedCount(), sight_revealer.SkippedCount());
     perf_log->Indent(2);
     StaticPerfClock::LogCalls();
     perf_log->Indent(-2);
@@ -2413,15 +2437,7 @@ void Unit::Kill(ProgressUnitResults *results)
         for (Unit *attacker : RemoveFromResults(results))
         {
             if (hotkey_groups & 0x80000000)
-            {
-                // Since this search might be really late in thread task queue, this thread does the search
-                // if it has not been finished
-                Unit **null = nullptr, **used = (Unit **)0x1;
-                if (nearby_helping_units.compare_exchange_strong(null, used, std::memory_order_release, std::memory_order_relaxed) == true)
-                {
-                    nearby_helping_units.store(FindNearbyHelpingUnits(this, &pbf_memory), std::memory_order_relaxed);
-                }
-            }
+                WaitNearbyHelpingUnits(this);
             else
                 nearby_helping_units.store(FindNearbyHelpingUnits(this, &pbf_memory), std::memory_order_relaxed);
             Puwh_Dying(this, attacker, nearby_helping_units.load(std::memory_order_relaxed), results);
@@ -4942,34 +4958,149 @@ void Unit::Order_Hallucinated(ProgressUnitResults *results)
     }
 }
 
-Unit **FindNearbyHelpingUnits(Unit *unit, TempMemoryPool *allocation_pool)
+static Rect16 HelperSearchArea(Unit *unit)
 {
-    Rect16 area;
     if (!unit->ai)
+        return Rect16(unit->sprite->position, CallFriends_Radius);
+
+    int search_radius = CallFriends_Radius;
+    if (units_dat_flags[unit->unit_id] & UnitFlags::Building)
+        search_radius *= 2;
+    if (bw::player_ai[unit->player].flags & 0x20)
+        search_radius *= 2;
+    return Rect16(unit->sprite->position, search_radius);
+}
+
+Unit **FindNearbyHelpingUnits(Unit *unit, TempMemoryPool *allocation_pool)
+{
+    return unit_search->FindHelpingUnits(unit, HelperSearchArea(unit), allocation_pool);
+}
+
+// Values of nearby_helping_units while the search is being done
+static Unit **const HelperSearch_MainThread = (Unit **)0x1;
+static Unit **const HelperSearch_Worker = (Unit **)0x2;
+
+static const unsigned int HelperSearchBatchSize = 64;
+static const unsigned int HelperSearchMaxBlockUnits = 16;
+static const int HelperSearchMaxBlockSize = 0x200;
+
+struct HelperSearchBlock
+{
+    Unit **units;
+    unsigned int count;
+};
+
+static vector<Unit *> helper_search_batch;
+static HelperSearchStats helper_search_stats;
+
+static void FindNearbyHelpingUnits_Block(ScThreadVars *tvars, HelperSearchBlock *block)
+{
+    TempMemoryPool *pool = &tvars->unit_search_pool;
+    Rect16 *areas = pool->Allocate<Rect16>(block->count);
+    Rect16 block_area;
+    unsigned int claimed = 0;
+    for (unsigned int i = 0; i < block->count; i++)
     {
-        area = Rect16(unit->sprite->position, CallFriends_Radius);
+        Unit *unit = block->units[i];
+        Unit **null = nullptr;
+        // Main thread may have not wanted to wait, and did the search itself
+        if (!unit->nearby_helping_units.compare_exchange_strong(null, HelperSearch_Worker, std::memory_order_acq_rel, std::memory_order_relaxed))
+            continue;
+        block->units[claimed] = unit;
+        areas[claimed] = HelperSearchArea(unit);
+        if (claimed == 0)
+            block_area = areas[claimed];
+        else
+        {
+            block_area.left = min(block_area.left, areas[claimed].left);
+            block_area.top = min(block_area.top, areas[claimed].top);
+            block_area.right = max(block_area.right, areas[claimed].right);
+            block_area.bottom = max(block_area.bottom, areas[claimed].bottom);
+        }
+        claimed++;
     }
-    else
+    if (claimed == 0)
+        return;
+
+    Unit **candidates = unit_search->FindHelpingUnitCandidates(block_area, pool);
+    for (unsigned int i = 0; i < claimed; i++)
     {
-        int search_radius = CallFriends_Radius;
-        if (units_dat_flags[unit->unit_id] & UnitFlags::Building)
-            search_radius *= 2;
-        if (bw::player_ai[unit->player].flags & 0x20)
-            search_radius *= 2;
-        area = Rect16(unit->sprite->position, search_radius);
+        Unit *unit = block->units[i];
+        Unit **result = unit_search->FilterHelpingUnits(unit, areas[i], candidates, pool);
+        unit->nearby_helping_units.store(result, std::memory_order_release);
     }
-    return unit_search->FindHelpingUnits(unit, area, allocation_pool);
 }
 
-void FindNearbyHelpingUnits_Threaded(ScThreadVars *tvars, Unit *unit)
+void FlushHelperSearches()
 {
-    // Main thread didn't want to wait
-    if (unit->nearby_helping_units.load(std::memory_order_relaxed) != nullptr)
+    if (helper_search_batch.empty())
         return;
-    Unit **null = nullptr;
-    // It is also possible that main thread took this one while the search was going on,
-    // in which case we just discard the result
-    unit->nearby_helping_units.compare_exchange_strong(null, FindNearbyHelpingUnits(unit, &tvars->unit_search_pool), std::memory_order_release, std::memory_order_relaxed);
+
+    auto SortKey = [](const Unit *unit) {
+        const Point &pos = unit->sprite->position;
+        return (uint32_t)(pos.y / HelperSearchMaxBlockSize) << 16 | pos.x;
+    };
+    std::sort(helper_search_batch.begin(), helper_search_batch.end(), [&](const Unit *a, const Unit *b) {
+        return SortKey(a) < SortKey(b);
+    });
+
+    // Split to blocks of nearby units
+    auto pos = helper_search_batch.begin();
+    while (pos != helper_search_batch.end())
+    {
+        const Point &first_pos = (*pos)->sprite->position;
+        auto block_end = pos + 1;
+        while (block_end != helper_search_batch.end() && (unsigned int)(block_end - pos) < HelperSearchMaxBlockUnits)
+        {
+            const Point &unit_pos = (*block_end)->sprite->position;
+            if (unit_pos.x - first_pos.x > HelperSearchMaxBlockSize || abs(unit_pos.y - first_pos.y) > HelperSearchMaxBlockSize)
+                break;
+            ++block_end;
+        }
+        HelperSearchBlock *block = pbf_memory.Allocate<HelperSearchBlock>();
+        block->count = block_end - pos;
+        block->units = pbf_memory.Allocate<Unit *>(block->count);
+        std::copy(pos, block_end, block->units);
+        threads->AddTask(&FindNearbyHelpingUnits_Block, block);
+        if (PerfTest)
+            helper_search_stats.tasks++;
+        pos = block_end;
+    }
+    helper_search_batch.clear();
+}
+
+Unit **WaitNearbyHelpingUnits(Unit *unit)
+{
+    Unit **result = unit->nearby_helping_units.load(std::memory_order_acquire);
+    if (result == nullptr)
+    {
+        // This search might be really late in thread task queue, so this thread does the search
+        if (unit->nearby_helping_units.compare_exchange_strong(result, HelperSearch_MainThread, std::memory_order_acq_rel, std::memory_order_acquire) == true)
+        {
+            result = FindNearbyHelpingUnits(unit, &pbf_memory);
+            unit->nearby_helping_units.store(result, std::memory_order_release);
+            if (PerfTest)
+                helper_search_stats.main_thread++;
+            return result;
+        }
+    }
+    if (result == HelperSearch_Worker)
+    {
+        STATIC_PERF_CLOCK(WaitNearbyHelpingUnits_Hang);
+        while (result == HelperSearch_Worker)
+        {
+            SwitchToThread();
+            result = unit->nearby_helping_units.load(std::memory_order_acquire);
+        }
+    }
+    return result;
+}
+
+HelperSearchStats TakeHelperSearchStats()
+{
+    HelperSearchStats ret = helper_search_stats;
+    helper_search_stats = HelperSearchStats();
+    return ret;
 }
 
 void Unit::StartHelperSearch()
@@ -4984,7 +5115,11 @@ void Unit::StartHelperSearch()
         if (ai || HasEnemies(player))
         {
             nearby_helping_units.store(nullptr, std::memory_order_relaxed);
-            threads->AddTask(&FindNearbyHelpingUnits_Threaded, this);
+            helper_search_batch.emplace_back(this);
+            if (PerfTest)
+                helper_search_stats.searches++;
+            if (helper_search_batch.size() >= HelperSearchBatchSize)
+                FlushHelperSearches();
         }
         else
             nearby_helping_units.store(&null, std::memory_order_relaxed);
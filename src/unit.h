@@ -410,18 +410,10 @@ class Unit
 
         Unit *next_temp_flagged;
         std::atomic<Unit **> nearby_helping_units;
-
-        // DamagedUnit data
-        class DamagedUnitPrivate
-        {
-            friend class DamagedUnit;
-            friend struct ProgressBulletBufs;
-            uint32_t valid_frame;
-            uint32_t damage; // Hp damage only
-
-            public:
-                constexpr DamagedUnitPrivate() : valid_frame(0), damage(0) { }
-        } dmg_unit;
+        // See CollisionPairs
+        uint32_t collision_pair_sweep;
+        uint32_t collision_pair_index;
+        uint32_t collision_pair_changed;
 
         /// For Ai::HitReactions.
         class AiReactionPrivate
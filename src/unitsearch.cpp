@@ -33,14 +33,25 @@ void MainUnitSearch::Validate()
     Assert(!valid_region_cache);
     Assert(!area_cache_enabled);
     Assert(std::is_sorted(left_positions.begin(), left_positions.end()));
+    unsigned removed = 0;
     for (int i = 0; i < (int)Size(); i++)
     {
-        Assert(left_to_value[i]->search_left == i);
+        if (IsRemoved(i))
+            removed++;
+        else
+            Assert(left_to_value[i]->search_left == i);
     }
+    Assert(removed == RemovedCount());
+}
+
+static void UpdateSearchLeft(Unit *unit, uintptr_t pos)
+{
+    unit->search_left = pos;
 }
 
 MainUnitSearch::MainUnitSearch()
 {
+    grid_enabled = false;
     capacity = 0x400;
     // This has huge problem as it may be reallocated if used with recursive calls
     // Should use some kind of deque maybe
@@ -58,13 +69,25 @@ MainUnitSearch::~MainUnitSearch()
     free(result_units_beg);
 }
 
+static Rect16 ChooseTargetRect(const Pathing::Region *region)
+{
+    return Rect16(Point(region->x >> 8, region->y >> 8), 0x120);
+}
+
 // This gets called once pathing has been inited - units may have been already added
 void MainUnitSearch::Init()
 {
     UnitSearch::Init();
     region_cache.SetSize((*bw::pathing)->region_count);
+    vector<Rect16> region_rects;
+    for (int i = 0; i < (*bw::pathing)->region_count; i++)
+        region_rects.emplace_back(ChooseTargetRect((*bw::pathing)->regions + i));
+    region_units.SetRegions(move(region_rects), *bw::map_width, *bw::map_height);
     area_cache.SetSize(*bw::map_width, *bw::map_height);
     enemy_unit_cache->SetSize(*bw::map_width, *bw::map_height);
+    grid.SetSize(*bw::map_width, *bw::map_height);
+    if (grid_enabled)
+        RebuildGrid();
 }
 
 void UnitSearch::Init()
@@ -75,6 +98,10 @@ void UnitSearch::Init()
 void MainUnitSearch::Clear()
 {
     PosSearch::Clear();
+    grid.Clear();
+    area_cache.Clear();
+    region_units.Clear();
+    collision_pairs.valid = false;
     left_low_invalid = INT_MAX;
     left_high_invalid = -1;
     valid_region_cache = false;
@@ -106,15 +133,14 @@ void MainUnitSearch::Add(Unit *unit)
         result_units_beg = (Unit **)malloc((capacity + 1) * 4 * sizeof(Unit **));
     }
 
-    int pos = NewFind(box.left);
-    for (unsigned i = pos; i < old_size; i++)
-    {
-        Unit *unit = left_to_value[i];
-        unit->search_left = i + 1;
-    }
-    PosSearch::Add(pos, move(unit), box);
-
-    unit->search_left = pos;
+    unit->search_left = Insert(move(unit), box, UpdateSearchLeft);
+    Rect32 rect(box.left, box.top, box.right, box.bottom);
+    InvalidateCaches(rect);
+    if (UseGrid())
+        grid.Add(unit, rect);
+    // The unit may have been in the search before, with values from an older sweep
+    unit->collision_pair_sweep = 0;
+    MarkChangedForCollisionPairs(unit);
 
     area_cache_enabled = false;
     Validate();
@@ -141,7 +167,7 @@ Unit **MainUnitSearch::FindCollidingUnits(Unit *unit, int x_radius, int y_radius
             min((int)*bw::map_width, cbox.right + x_radius), min((int)*bw::map_height, cbox.bottom + y_radius));
 
     int amt;
-    Unit **units = FindUnitsRect(area, &amt);
+    Unit **units = FindUnitsNear(unit, area, &amt);
     PopResult();
     Unit **ret = units;
     Unit **out_pos = units, **end = units + amt;
@@ -207,7 +233,7 @@ Unit **MainUnitSearch::FindUnitsRect(const Rect16 &rect, int *amount, Unit **out
     else
     {
         ret = out;
-        UnitSearch::Find(rect, out, &out);
+        FindRect(rect, out, &out);
     }
 
     *amount = out - ret;
@@ -217,6 +243,25 @@ Unit **MainUnitSearch::FindUnitsRect(const Rect16 &rect, int *amount, Unit **out
     return ret;
 }
 
+Unit **MainUnitSearch::FindUnitsNear(Unit *unit, const Rect16 &rect, int *amount, Unit **out)
+{
+    Unit **ret = out;
+    if (out == nullptr)
+        ret = NewEntry();
+    Unit **end;
+    if (!FindFromCollisionPairs(unit, rect, ret, &end))
+    {
+        if (out == nullptr)
+            PopResult();
+        return FindUnitsRect(rect, amount, out);
+    }
+    *amount = end - ret;
+    *end++ = nullptr;
+    if (out == nullptr)
+        *bw::position_search_units_count = end - result_units_beg;
+    return ret;
+}
+
 void MainUnitSearch::AreaCacheFind(const Rect16 &rect, Unit **out, Unit ***out_end, UnitSearchAreaCache::AreaBuffer<Unit *> *out_bufs, UnitSearchAreaCache::AreaBuffer<Unit *> **out_bufs_end)
 {
     STATIC_PERF_CLOCK(UnitSearch_AreaCacheFind);
@@ -224,7 +269,7 @@ void MainUnitSearch::AreaCacheFind(const Rect16 &rect, Unit **out, Unit ***out_e
     if (area.IsValid())
     {
         Unit **end;
-        UnitSearch::Find(area, out, &end);
+        FindRect(area, out, &end);
         area_cache.FillCache(area, Array<Unit *>(out, end));
     }
     area_cache.Find(rect, out, out_end, out_bufs, out_bufs_end);
@@ -237,7 +282,7 @@ void MainUnitSearch::CacheArea(const Rect16 &rect)
     {
         Unit **out = NewEntry();
         Unit **end;
-        UnitSearch::Find(area, out, &end);
+        FindRect(area, out, &end);
         area_cache.FillCache(area, Array<Unit *>(out, end));
         PopResult();
     }
@@ -251,25 +296,49 @@ Unit **MainUnitSearch::FindUnitBordersRect(const Rect16 *rect)
     bw::position_search_results_offsets[*bw::position_search_results_count] = *bw::position_search_units_count;
     (*bw::position_search_results_count)++;
 
-    int beg = NewFind(rect->left - *bw::unit_max_width);
-    int end = NewFind(rect->right);
+    out = FindBorders(*rect, out, UseGrid());
+    if (Debug && UseGrid())
+    {
+        Unit **check_end = FindBorders(*rect, out, false);
+        Assert(check_end - out == out - result_beg && std::equal(result_beg, out, out));
+    }
+
+    *out++ = nullptr;
+    *bw::position_search_units_count = out - result_units_beg;
+    return result_beg;
+}
+
+Unit **MainUnitSearch::FindBorders(const Rect16 &rect, Unit **out, bool use_grid)
+{
+    if (use_grid)
+    {
+        Unit **end = GridFind(Rect32(rect.left, rect.top, rect.right, rect.bottom), rect.left - *bw::unit_max_width, out);
+        for (Unit **it = out; it != end; ++it)
+        {
+            int pos = (*it)->search_left;
+            if (rect.top > left_to_top[pos] && rect.bottom < left_to_bottom[pos])
+                continue;
+            *out++ = *it;
+        }
+        return out;
+    }
+
+    int beg = NewFind(rect.left - *bw::unit_max_width);
+    int end = NewFind(rect.right);
     for (int it = beg; it < end; it++)
     {
-        if (left_to_right[it] > rect->left)
+        if (left_to_right[it] > rect.left)
         {
-            if (rect->top < left_to_bottom[it] && rect->bottom > left_to_top[it])
+            if (rect.top < left_to_bottom[it] && rect.bottom > left_to_top[it])
             {
                 // Stay true for the "borders" part just in case
-                if (rect->top > left_to_top[it] && rect->bottom < left_to_bottom[it])
+                if (rect.top > left_to_top[it] && rect.bottom < left_to_bottom[it])
                     continue;
                 *out++ = left_to_value[it];
             }
         }
     }
-
-    *out++ = nullptr;
-    *bw::position_search_units_count = out - result_units_beg;
-    return result_beg;
+    return out;
 }
 
 int MainUnitSearch::DoUnitsCollide(const Unit *first, const Unit *second)
@@ -341,7 +410,7 @@ Unit **MainUnitSearch::CheckMovementCollision(Unit *unit, int x_off, int y_off)
     {
         Unit **pos = out;
         int len = 0;
-        FindUnitsRect(eka, &len, pos);
+        FindUnitsNear(unit, eka, &len, pos);
         Unit **end = pos + len;
         while (pos != end)
         {
@@ -360,7 +429,7 @@ Unit **MainUnitSearch::CheckMovementCollision(Unit *unit, int x_off, int y_off)
     {
         Unit **pos = out;
         int len = 0;
-        FindUnitsRect(toka, &len, pos);
+        FindUnitsNear(unit, toka, &len, pos);
         Unit **end = pos + len;
         while (pos != end)
         {
@@ -386,6 +455,7 @@ void MainUnitSearch::ChangeUnitPosition(Unit *unit, int x_diff, int y_diff)
         return;
 
     Validate();
+    UpdateMovedRect(unit, x_diff, y_diff);
     left_positions[unit->search_left] += x_diff;
     left_to_right[unit->search_left] += x_diff;
     left_to_top[unit->search_left] += y_diff;
@@ -397,7 +467,8 @@ void MainUnitSearch::ChangeUnitPosition(Unit *unit, int x_diff, int y_diff)
         for (it = unit->search_left + 1; it < Size() && left_positions[it] < changed; it++)
         {
             Unit *unit = left_to_value[it];
-            unit->search_left = it - 1;
+            if (unit != nullptr)
+                unit->search_left = it - 1;
             std::swap(left_positions[it - 1], left_positions[it]);
         }
         int pos = unit->search_left;
@@ -414,7 +485,8 @@ void MainUnitSearch::ChangeUnitPosition(Unit *unit, int x_diff, int y_diff)
         for (it = unit->search_left - 1; it >= 0 && left_positions[it] > changed; it--)
         {
             Unit *unit = left_to_value[it];
-            unit->search_left = it + 1;
+            if (unit != nullptr)
+                unit->search_left = it + 1;
             std::swap(left_positions[it + 1], left_positions[it]);
         }
         int pos = unit->search_left;
@@ -442,6 +514,7 @@ void MainUnitSearch::ChangeUnitPosition_Fast(Unit *unit, int x_diff, int y_diff)
     }
     if (x_diff != 0)
         Assert(left_low_invalid >= 0 && left_high_invalid >= 0);
+    UpdateMovedRect(unit, x_diff, y_diff);
     left_positions[unit->search_left] += x_diff;
     left_to_right[unit->search_left] += x_diff;
     left_to_top[unit->search_left] += y_diff;
@@ -574,7 +647,13 @@ void MainUnitSearch::ChangeUnitPosition_Finish()
         for (int i = low; i < high; i++)
         {
             Unit *unit = left_to_value[i];
-            unit->search_left = i;
+            if (unit != nullptr && unit->search_left != i)
+            {
+                // Sorting may swap units with equal left, which would change the order
+                // they are in their cached areas
+                area_cache.Invalidate(SearchRect(i));
+                unit->search_left = i;
+            }
         }
 
         left_low_invalid = INT_MAX;
@@ -586,7 +665,7 @@ void MainUnitSearch::ChangeUnitPosition_Finish()
 
 Unit *MainUnitSearch::FindNearestUnit(Unit *self, const Point &pos, int (__fastcall *IsValid)(const Unit *, void *), void *func_param, const Rect16 &area)
 {
-    return UnitSearch::FindNearest(pos, area, [self, IsValid, func_param](const Unit *unit) -> bool {
+    return FindNearest(pos, area, [self, IsValid, func_param](const Unit *unit) -> bool {
         return self != unit && IsValid(unit, func_param);
     });
 }
@@ -674,21 +753,324 @@ void MainUnitSearch::GetNearbyBlockingUnits(PathingData *pd)
 
 void MainUnitSearch::Remove(Unit *unit)
 {
+    STATIC_PERF_CLOCK(UnitSearch_Remove);
     Validate();
-    unsigned old_size = Size();
+    // Removed entries are left in place, so removing does not have to update search_left
+    // of every unit after it. Add() reuses them, but if a lot of units die at once,
+    // they get compacted as they would slow down the searches.
+    Rect32 rect = SearchRect(unit->search_left);
+    InvalidateCaches(rect);
+    if (UseGrid())
+        grid.Remove(unit, rect);
+    MarkChangedForCollisionPairs(unit);
+    MarkRemoved(unit->search_left);
+    unit->search_left = -1;
+    unit->search_right = -1;
+    if (RemovedCount() > 32 + Size() / 8)
+    {
+        STATIC_PERF_CLOCK(UnitSearch_Compact);
+        Compact(UpdateSearchLeft);
+    }
 
-    for (unsigned i = unit->search_left + 1; i < old_size; i++)
+    area_cache_enabled = false;
+    Validate();
+}
+
+void MainUnitSearch::SetGridEnabled(bool enable)
+{
+    if (enable && !grid_enabled)
     {
+        grid_enabled = true;
+        if (grid.IsInited())
+            RebuildGrid();
+    }
+    grid_enabled = enable;
+}
+
+void MainUnitSearch::RebuildGrid()
+{
+    grid.Clear();
+    for (unsigned i = 0; i < Size(); i++)
+    {
+        if (!IsRemoved(i))
+            grid.Add(left_to_value[i], SearchRect(i));
+    }
+}
+
+void MainUnitSearch::InvalidateCaches(const Rect32 &rect)
+{
+    area_cache.Invalidate(rect);
+    region_units.Invalidate(rect);
+}
+
+void MainUnitSearch::UpdateMovedRect(Unit *unit, int x_diff, int y_diff)
+{
+    if (x_diff == 0 && y_diff == 0)
+        return;
+    Rect32 old_rect = SearchRect(unit->search_left);
+    Rect32 new_rect(old_rect.left + x_diff, old_rect.top + y_diff, old_rect.right + x_diff, old_rect.bottom + y_diff);
+    InvalidateCaches(old_rect);
+    InvalidateCaches(new_rect);
+    if (UseGrid())
+        grid.Move(unit, old_rect, new_rect);
+    MarkChangedForCollisionPairs(unit);
+}
+
+// Sweep and prune: as units are sorted by left, a unit can only pair with the units before it
+// whose right is past its left. Those are kept in active list, from which the rest are dropped.
+void MainUnitSearch::SweepCollisionPairs()
+{
+    STATIC_PERF_CLOCK(UnitSearch_SweepCollisionPairs);
+    const int margin = CollisionPairs::Margin;
+    auto &pairs = collision_pairs;
+    // In large fights enough units move each frame that the pairs get discarded, and then
+    // the sweep would be wasted work. Back off until the pairs last for a frame again.
+    if (pairs.dropped)
+    {
+        pairs.dropped = false;
+        pairs.skip_sweeps = std::min(std::max(pairs.skip_sweeps * 2, 1), (int)CollisionPairs::MaxSkippedSweeps);
+        pairs.skip_remaining = pairs.skip_sweeps;
+    }
+    else if (pairs.valid)
+    {
+        pairs.skip_sweeps = 0;
+    }
+    if (pairs.skip_remaining != 0)
+    {
+        pairs.skip_remaining--;
+        pairs.valid = false;
+        if (PerfTest)
+            collision_pair_stats.skipped_sweeps++;
+        return;
+    }
+
+    pairs.sweep_id++;
+    pairs.units.clear();
+    pairs.active.clear();
+    pairs.pair_buf.clear();
+    pairs.changed_units.clear();
+    for (unsigned i = 0; i < Size(); i++)
+    {
+        if (IsRemoved(i))
+            continue;
         Unit *unit = left_to_value[i];
-        unit->search_left = i - 1;
+        uint32_t index = pairs.units.size();
+        int left = left_positions[i], top = left_to_top[i], bottom = left_to_bottom[i];
+        unsigned out = 0;
+        for (uint32_t other : pairs.active)
+        {
+            int other_pos = pairs.units[other]->search_left;
+            if (left_to_right[other_pos] + margin <= left)
+                continue;
+            pairs.active[out++] = other;
+            if (left_to_top[other_pos] - margin < bottom && left_to_bottom[other_pos] + margin > top)
+                pairs.pair_buf.emplace_back(other, index);
+        }
+        pairs.active.resize(out);
+        pairs.active.emplace_back(index);
+        pairs.units.emplace_back(unit);
+        unit->collision_pair_sweep = pairs.sweep_id;
+        unit->collision_pair_index = index;
+    }
+    uint32_t count = pairs.units.size();
+    pairs.offsets.clear();
+    pairs.offsets.resize(count + 1);
+    for (const auto &pair : pairs.pair_buf)
+    {
+        pairs.offsets[pair.first + 1]++;
+        pairs.offsets[pair.second + 1]++;
+    }
+    for (uint32_t i = 0; i < count; i++)
+        pairs.offsets[i + 1] += pairs.offsets[i];
+    pairs.neighbours.resize(pairs.pair_buf.size() * 2);
+    // Active is no longer needed, and is used as write position of each unit.
+    // Pair_buf is sorted by second, and the firsts of each second are ascending, so the
+    // neighbours of every unit end up sorted.
+    pairs.active.assign(pairs.offsets.begin(), pairs.offsets.end() - 1);
+    for (const auto &pair : pairs.pair_buf)
+    {
+        pairs.neighbours[pairs.active[pair.first]++] = pair.second;
+        pairs.neighbours[pairs.active[pair.second]++] = pair.first;
+    }
+    pairs.valid = true;
+    if (PerfTest)
+    {
+        collision_pair_stats.pairs += pairs.pair_buf.size();
+        collision_pair_stats.sweeps++;
     }
+}
 
-    RemoveAt(unit->search_left);
-    unit->search_left = -1;
-    unit->search_right = -1;
+CollisionPairStats MainUnitSearch::TakeCollisionPairStats()
+{
+    CollisionPairStats ret = collision_pair_stats;
+    collision_pair_stats = CollisionPairStats();
+    return ret;
+}
 
-    area_cache_enabled = false;
-    Validate();
+int MainUnitSearch::CollisionPairIndex(const Unit *unit) const
+{
+    if (unit->collision_pair_sweep != collision_pairs.sweep_id)
+        return -1;
+    return unit->collision_pair_index;
+}
+
+bool MainUnitSearch::ChangedAfterCollisionPairs(const Unit *unit) const
+{
+    return unit->collision_pair_changed == collision_pairs.sweep_id;
+}
+
+void MainUnitSearch::MarkChangedForCollisionPairs(Unit *unit)
+{
+    auto &pairs = collision_pairs;
+    if (!pairs.valid || ChangedAfterCollisionPairs(unit))
+        return;
+    unit->collision_pair_changed = pairs.sweep_id;
+    if (pairs.changed_units.size() == CollisionPairs::MaxChanged)
+    {
+        pairs.valid = false;
+        pairs.dropped = true;
+        if (PerfTest)
+            collision_pair_stats.dropped++;
+        return;
+    }
+    pairs.changed_units.emplace_back(unit);
+}
+
+// Gives the same result as UnitSearch::Find(rect), if unit has not changed since the sweep
+// and rect is inside unit's collision rect extended by the margin: every unit in rect is then
+// either a neighbour of unit, unit itself, or a changed unit.
+bool MainUnitSearch::FindFromCollisionPairs(Unit *unit, const Rect16 &rect, Unit **out, Unit ***out_end)
+{
+    const auto &pairs = collision_pairs;
+    if (!pairs.valid || area_cache_enabled || unit->search_left == -1)
+        return false;
+    int index = CollisionPairIndex(unit);
+    const int margin = CollisionPairs::Margin;
+    Rect32 own = SearchRect(unit->search_left);
+    if (index == -1 || ChangedAfterCollisionPairs(unit) || (int)rect.left < own.left - margin ||
+            (int)rect.right > own.right + margin || (int)rect.top < own.top - margin ||
+            (int)rect.bottom > own.bottom + margin)
+    {
+        if (PerfTest)
+            collision_pair_stats.fallbacks++;
+        return false;
+    }
+    if (PerfTest)
+        collision_pair_stats.searches++;
+
+    Unit **beg = out;
+    int min_left = rect.left - max_width;
+    auto AddIfInside = [&](Unit *other) {
+        int pos = other->search_left;
+        if (left_positions[pos] >= min_left && left_positions[pos] < rect.right && left_to_right[pos] > rect.left &&
+                left_to_top[pos] < rect.bottom && left_to_bottom[pos] > rect.top)
+        {
+            *out++ = other;
+        }
+    };
+    // Unchanged units have kept their order, so they are added in the order of the sweep,
+    // and only the few changed units have to be sorted and merged in
+    bool own_added = false;
+    for (uint32_t i = pairs.offsets[index]; i < pairs.offsets[index + 1]; i++)
+    {
+        uint32_t other = pairs.neighbours[i];
+        if (!own_added && other > (uint32_t)index)
+        {
+            AddIfInside(unit);
+            own_added = true;
+        }
+        Unit *other_unit = pairs.units[other];
+        if (!ChangedAfterCollisionPairs(other_unit))
+            AddIfInside(other_unit);
+    }
+    if (!own_added)
+        AddIfInside(unit);
+    Unit **unchanged_end = out;
+    for (Unit *other : pairs.changed_units)
+    {
+        if (other->search_left != -1)
+            AddIfInside(other);
+    }
+    auto compare = [](const Unit *a, const Unit *b) { return a->search_left < b->search_left; };
+    std::sort(unchanged_end, out, compare);
+    std::inplace_merge(beg, unchanged_end, out, compare);
+    *out_end = out;
+    if (Debug)
+    {
+        Unit **check_end;
+        UnitSearch::Find(rect, out, &check_end);
+        Assert(check_end - out == out - beg && std::equal(beg, out, out));
+    }
+    return true;
+}
+
+void MainUnitSearch::FindRect(const Rect16 &rect, Unit **out, Unit ***out_end)
+{
+    if (!UseGrid())
+    {
+        UnitSearch::Find(rect, out, out_end);
+        return;
+    }
+    Assert(rect.left <= rect.right && rect.top <= rect.bottom);
+    *out_end = GridFind(Rect32(rect.left, rect.top, rect.right, rect.bottom), rect.left - max_width, out);
+    if (Debug)
+    {
+        Unit **check_end;
+        UnitSearch::Find(rect, *out_end, &check_end);
+        Assert(check_end - *out_end == *out_end - out && std::equal(out, *out_end, *out_end));
+    }
+}
+
+// Accepts exactly the units PosSearch::Find would with left_to_right[it] > rect.left etc.
+// A unit is in every cell its rect touches, so it is only taken from the cell containing
+// the top left corner of its intersection with rect.
+Unit **MainUnitSearch::GridFind(const Rect32 &rect, int min_left, Unit **out)
+{
+    STATIC_PERF_CLOCK(UnitSearch_GridFind);
+    Unit **beg = out;
+    grid.ForEachCandidate(rect, [&](Unit *unit, int cell_x, int cell_y) {
+        int pos = unit->search_left;
+        int left = left_positions[pos], top = left_to_top[pos];
+        if (left < min_left || left >= rect.right || left_to_right[pos] <= rect.left)
+            return;
+        if (top >= rect.bottom || left_to_bottom[pos] <= rect.top)
+            return;
+        if (grid.CellX(max(left, (int)rect.left)) != cell_x || grid.CellY(max(top, (int)rect.top)) != cell_y)
+            return;
+        *out++ = unit;
+    });
+    std::sort(beg, out, [](const Unit *a, const Unit *b) { return a->search_left < b->search_left; });
+    return out;
+}
+
+// PosSearch::FindNearest walks the arrays to both directions from pos.x, one entry to each
+// direction at time, and only checks units' position against the area bound which is on its
+// side. The candidates are ordered in the same way, so the first of equally distant units wins.
+Unit **MainUnitSearch::GridFindNearestCandidates(const Point &pos, const Rect16 &area, Unit **out)
+{
+    int right_pos = NewFind(pos.x);
+    // Units have their position inside their collision rect
+    Rect32 rect(std::min((int)area.left, (int)pos.x), area.top, std::max((int)area.right, pos.x + 1), area.bottom);
+    Unit **beg = out;
+    Unit **end = GridFind(rect, INT_MIN, out);
+    for (Unit **it = beg; it != end; ++it)
+    {
+        Unit *unit = *it;
+        const auto &val_pos = unit->sprite->position;
+        if (val_pos.y >= area.bottom || val_pos.y < area.top)
+            continue;
+        if (unit->search_left < right_pos ? val_pos.x < area.left : val_pos.x >= area.right)
+            continue;
+        *out++ = unit;
+    }
+    auto VisitOrder = [right_pos](const Unit *unit) {
+        if (unit->search_left < right_pos)
+            return (right_pos - 1 - unit->search_left) * 2;
+        else
+            return (unit->search_left - right_pos) * 2 + 1;
+    };
+    std::sort(beg, out, [&](const Unit *a, const Unit *b) { return VisitOrder(a) < VisitOrder(b); });
+    return out;
 }
 
 static int GetOthersLocationForDodging(const Unit *own, const Unit *other, int dispreference)
@@ -873,13 +1255,15 @@ void MainUnitSearch::EnableAreaCache()
 {
     if (area_cache_enabled)
         return;
-    area_cache.Clear();
+    // Areas stay valid between frames, as every change to the unit search invalidates
+    // the areas that it touches
+    if (area_cache.NeedsClear())
+        area_cache.Clear();
     area_cache_enabled = true;
 }
 
 void MainUnitSearch::DisableAreaCache()
 {
-    // No need to clear
     area_cache_enabled = false;
 }
 
@@ -992,6 +1376,114 @@ struct iterator_traits<ChooseTargetSort>
 };
 }
 
+// Based on FindUnitBordersRect
+Unit **MainUnitSearch::FindRegionUnits(const Rect16 &rect, Unit **out)
+{
+    unsigned int beg, end;
+    beg = NewFind(rect.left - *bw::unit_max_width);
+    end = NewFind(rect.right);
+
+    for (unsigned int it = beg; it < end; it++)
+    {
+        if (left_to_right[it] > rect.left)
+        {
+            // FindUnitBordersRect does also skip units containing the entire rect to be
+            // truly "borders only", just in case some weird bw function depends on it,
+            // but I doubt it is necessary here.
+            if (rect.top < left_to_bottom[it] && rect.bottom > left_to_top[it])
+                *out++ = left_to_value[it];
+        }
+    }
+    return out;
+}
+
+static bool CanChooseTarget(const Unit *unit)
+{
+    if (unit->order == Order::Die || unit->IsInvincible())
+        return false;
+    return ~unit->flags & UnitStatus::Hallucination || unit->GetHealth() == unit->GetMaxHealth();
+}
+
+// Sorts units by player, strength descending and lookup_id, strength[] gets reordered as well.
+// Larger arrays are radix sorted by player and strength, which leaves only the units with
+// equal strength to be ordered by lookup_id.
+void MainUnitSearch::SortChooseTargetUnits(Unit **units, uint32_t *strength, uint32_t count)
+{
+    STATIC_PERF_CLOCK(UnitSearch_FindUnits_CT_sort);
+    if (count < 64)
+    {
+        std::sort(ChooseTargetSort(units, units, strength), ChooseTargetSort(units, units + count, strength));
+        return;
+    }
+
+    // Four passes for the bytes of ~strength, and a last one for player
+    const int passes = 5;
+    uint32_t counts[passes][256];
+    memset(counts, 0, sizeof counts);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t key = ~strength[i];
+        counts[0][key & 0xff]++;
+        counts[1][(key >> 8) & 0xff]++;
+        counts[2][(key >> 16) & 0xff]++;
+        counts[3][key >> 24]++;
+        counts[4][units[i]->player]++;
+    }
+    auto Digit = [](int pass, const Unit *unit, uint32_t str) -> uint32_t {
+        if (pass == 4)
+            return unit->player;
+        return ((~str) >> (pass * 8)) & 0xff;
+    };
+
+    choose_target_sort_units.resize(count);
+    choose_target_sort_strength.resize(count);
+    Unit **src_units = units, **dest_units = choose_target_sort_units.data();
+    uint32_t *src_str = strength, *dest_str = choose_target_sort_strength.data();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        // Passes where every unit has the same digit would not change anything
+        if (counts[pass][Digit(pass, src_units[0], src_str[0])] == count)
+            continue;
+        uint32_t offset = 0;
+        for (uint32_t &digit_count : counts[pass])
+        {
+            uint32_t next = offset + digit_count;
+            digit_count = offset;
+            offset = next;
+        }
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t pos = counts[pass][Digit(pass, src_units[i], src_str[i])]++;
+            dest_units[pos] = src_units[i];
+            dest_str[pos] = src_str[i];
+        }
+        std::swap(src_units, dest_units);
+        std::swap(src_str, dest_str);
+    }
+    if (src_units != units)
+    {
+        std::copy(src_units, src_units + count, units);
+        std::copy(src_str, src_str + count, strength);
+    }
+
+    for (uint32_t begin = 0, end; begin < count; begin = end)
+    {
+        for (end = begin + 1; end < count; end++)
+        {
+            if (units[end]->player != units[begin]->player || strength[end] != strength[begin])
+                break;
+        }
+        std::sort(units + begin, units + end, [](const Unit *a, const Unit *b) {
+            return a->lookup_id < b->lookup_id;
+        });
+    }
+    if (Debug)
+    {
+        for (uint32_t i = 1; i < count; i++)
+            Assert(ChooseTargetSort::Compare(units[i - 1], units[i], strength[i - 1], strength[i]));
+    }
+}
+
 // Result is sorted by GetCurrentStrength(ground), so ChooseTarget can stop as soon as it finds
 // acceptable unit
 // Returns one array for each player
@@ -1012,61 +1504,66 @@ UnitSearchRegionCache::Entry MainUnitSearch::FindUnits_ChooseTarget(int region_i
             auto size = entry.take().Size();
             Unit **copy = region_cache.NewEntry(size);
             memcpy(copy, entry.take().GetRaw(), size * sizeof(Unit *));
-            auto str_beg = make_unique<uint32_t[]>(size);
-            auto str_end = str_beg.get() + size;
-            for (auto str_out = str_beg.get(); str_out != str_end; str_out++)
-            {
-                auto i = str_out - str_beg.get();
-                *str_out = GetCurrentStrength(copy[i], ground);
-            }
-            std::sort(ChooseTargetSort(copy, copy, str_beg.get()), ChooseTargetSort(copy, copy + size, str_beg.get()));
+            choose_target_strength.resize(size);
+            uint32_t *strength = choose_target_strength.data();
+            for (uintptr_t i = 0; i < size; i++)
+                strength[i] = GetCurrentStrength(copy[i], ground);
+            SortChooseTargetUnits(copy, strength, size);
             return region_cache.FinishEntry(copy, region_id, ground, size);
         }
     }
     STATIC_PERF_CLOCK(UnitSearch_FindUnits_ChooseTarget);
 
-    // Based on FindUnitBordersRect
-    Pathing::Region *region = (*bw::pathing)->regions + region_id;
-    Rect16 rect(Point(region->x >> 8, region->y >> 8), 0x120);
-    Unit **out, **result_beg;
-
-    out = result_beg = region_cache.NewEntry(Size() + 1);
-    // Allocate a separate array to hold GetCurrentStrength as calling it for every comparision is slow
-    // (first field is entry to out[], second is the strength)
-    auto str_beg = make_unique<uintptr_t[]>(Size() + 1);
-    uintptr_t *str_out = str_beg.get();
-    unsigned int beg, end;
-    beg = NewFind(rect.left - *bw::unit_max_width);
-    end = NewFind(rect.right);
+    // The units touching the region's rect are kept from earlier frames, unless something has
+    // changed there. Whether they can be targeted and their strength are checked every time.
+    vector<Unit *> *units = region_units.Find(region_id, ground);
+    if (units == nullptr)
+    {
+        Unit **result_beg = NewEntry();
+        Unit **out = FindRegionUnits(region_units.RegionRect(region_id), result_beg);
+        units = region_units.Set(region_id, ground, result_beg, out);
+        PopResult();
+    }
+    else if (Debug)
+    {
+        Unit **result_beg = NewEntry();
+        Unit **out = FindRegionUnits(region_units.RegionRect(region_id), result_beg);
+        Assert(std::is_permutation(result_beg, out, units->begin(), units->end()));
+        PopResult();
+    }
 
-    for (unsigned int it = beg; it < end; it++)
+    Unit **out, **result_beg;
+    out = result_beg = region_cache.NewEntry(units->size() + 1);
+    for (Unit *unit : *units)
     {
-        if (left_to_right[it] > rect.left)
+        if (CanChooseTarget(unit))
+            *out++ = unit;
+    }
+    // Calling GetCurrentStrength for every comparision would be slow
+    uint32_t count = out - result_beg;
+    choose_target_strength.resize(count);
+    uint32_t *strength = choose_target_strength.data();
+    for (uint32_t i = 0; i < count; i++)
+        strength[i] = GetCurrentStrength(result_beg[i], ground);
+
+    bool sorted = true;
+    for (uint32_t i = 1; i < count && sorted; i++)
+        sorted = !ChooseTargetSort::Compare(result_beg[i], result_beg[i - 1], strength[i], strength[i - 1]);
+    if (!sorted)
+    {
+        region_units.CountResort();
+        SortChooseTargetUnits(result_beg, strength, count);
+        // Keeps the order for next frame, units which were skipped are moved to the end.
+        // The entry has space for them, as it was allocated for every unit of the region.
+        Unit **skipped_end = out;
+        for (Unit *unit : *units)
         {
-            if (rect.top < left_to_bottom[it] && rect.bottom > left_to_top[it])
-            {
-                Unit *unit = left_to_value[it];
-                if (unit->order != Order::Die && !unit->IsInvincible())
-                {
-                    // FindUnitBordersRect does this to be truly "borders only",
-                    // just in case some weird bw function depends on it,
-                    // but I doubt it is necessary here.
-                    // if (rect->top > left_to_top[it] && rect->bottom < left_to_bottom[it])
-                    //     continue;
-                    if (~unit->flags & UnitStatus::Hallucination || unit->GetHealth() == unit->GetMaxHealth())
-                    {
-                        *out++ = unit;
-                        *str_out = GetCurrentStrength(unit, ground);
-                        str_out++;
-                    }
-                }
-            }
+            if (!CanChooseTarget(unit))
+                *skipped_end++ = unit;
         }
+        std::copy(result_beg, skipped_end, units->begin());
     }
-
-    STATIC_PERF_CLOCK(UnitSearch_FindUnits_CT_sort);
-    std::sort(ChooseTargetSort(result_beg, result_beg, str_beg.get()), ChooseTargetSort(result_beg, out, str_beg.get()));
-    return region_cache.FinishEntry(result_beg, region_id, ground, out - result_beg);
+    return region_cache.FinishEntry(result_beg, region_id, ground, count);
 }
 
 Unit **MainUnitSearch::FindHelpingUnits(Unit *own, const Rect16 &rect, TempMemoryPool *allocation_pool)
@@ -1106,3 +1603,57 @@ Unit **MainUnitSearch::FindHelpingUnits(Unit *own, const Rect16 &rect, TempMemor
     allocation_pool->SetPos(out);
     return result_beg;
 }
+
+Unit **MainUnitSearch::FindHelpingUnitCandidates(const Rect16 &rect, TempMemoryPool *allocation_pool)
+{
+    Unit **out, **result_beg = allocation_pool->Allocate<Unit *>(Size() + 1);
+    out = result_beg;
+
+    unsigned int beg, end;
+    beg = NewFind(rect.left - max_width);
+    end = NewFind(rect.right);
+    for (unsigned int it = beg; it < end; it++)
+    {
+        if (left_to_right[it] > rect.left)
+        {
+            if (rect.top < left_to_bottom[it] && rect.bottom > left_to_top[it])
+            {
+                Unit *unit = left_to_value[it];
+                // Same checks as in FindHelpingUnits which do not depend on the searching unit
+                if (unit->unit_id == Unit::Arbiter || unit->IsWorker())
+                    continue;
+                *out++ = unit;
+            }
+        }
+    }
+    *out++ = nullptr;
+    allocation_pool->SetPos(out);
+    return result_beg;
+}
+
+Unit **MainUnitSearch::FilterHelpingUnits(Unit *own, const Rect16 &rect, Unit **candidates, TempMemoryPool *allocation_pool)
+{
+    int count = 0;
+    for (Unit **it = candidates; *it != nullptr; ++it)
+        count++;
+    Unit **out, **result_beg = allocation_pool->Allocate<Unit *>(count + 1);
+    out = result_beg;
+
+    int left_min = rect.left - max_width;
+    for (Unit *unit = *candidates++; unit; unit = *candidates++)
+    {
+        // Has to match the range FindHelpingUnits would have checked
+        unsigned int pos = unit->search_left;
+        if (left_positions[pos] < left_min || left_positions[pos] >= rect.right)
+            continue;
+        if (left_to_right[pos] > rect.left && rect.top < left_to_bottom[pos] && rect.bottom > left_to_top[pos])
+        {
+            if (unit->player != own->player || unit == own)
+                continue;
+            *out++ = unit;
+        }
+    }
+    *out++ = nullptr;
+    allocation_pool->SetPos(out);
+    return result_beg;
+}
@@ -4,6 +4,9 @@
 #include "types.h"
 #include "unit.h"
 #include "unitsearch_cache.h"
+#include "unitsearch_grid.h"
+
+#include <utility>
 
 #pragma pack(push)
 #pragma pack(1)
@@ -25,20 +28,84 @@ struct CollisionArea
 class LeftSortHelper;
 class RightSortHelper;
 
+struct CollisionPairStats
+{
+    CollisionPairStats() : pairs(0), searches(0), fallbacks(0), sweeps(0), skipped_sweeps(0), dropped(0) {}
+    int pairs;
+    // Searches that could use the pairs, and ones that had to search normally
+    int searches;
+    int fallbacks;
+    int sweeps;
+    int skipped_sweeps;
+    // Sweeps whose pairs were discarded due to too many changes
+    int dropped;
+};
+
+/// Result of MainUnitSearch::SweepCollisionPairs(). Units are indexed in the order
+/// they were in unit search during the sweep. Unit::collision_pair_index is the index
+/// of an unit, if its collision_pair_sweep is sweep_id, and units which have changed
+/// after the sweep have collision_pair_changed set to sweep_id.
+struct CollisionPairs
+{
+    CollisionPairs() : valid(false), dropped(false), sweep_id(0), skip_sweeps(0), skip_remaining(0) {}
+
+    // Units are considered neighbours if their collision rects are closer than this
+    static const int Margin = 32;
+    // If more units than this change, the pairs are just discarded
+    static const unsigned MaxChanged = 128;
+    // If the pairs keep getting discarded, sweeps are skipped for up to this many frames
+    static const int MaxSkippedSweeps = 32;
+
+    bool valid;
+    bool dropped;
+    uint32_t sweep_id;
+    int skip_sweeps;
+    int skip_remaining;
+    vector<Unit *> units;
+    // Neighbours of unit i are neighbours[offsets[i]] .. neighbours[offsets[i + 1]],
+    // sorted by index
+    vector<uint32_t> offsets;
+    vector<uint32_t> neighbours;
+    // All changed units, including ones that were added after the sweep
+    vector<Unit *> changed_units;
+
+    // Scratch memory for the sweep
+    vector<uint32_t> active;
+    vector<std::pair<uint32_t, uint32_t>> pair_buf;
+};
+
 template <class Type>
 class PosSearch
 {
     public:
-        PosSearch() :max_width(0) {}
+        PosSearch() :max_width(0), removed_count(0) {}
         PosSearch(PosSearch &&other) = default;
         void Clear();
         void RemoveAt(uintptr_t pos);
+        /// Leaves an entry which will never match any search in place of pos, so nothing has to be moved.
+        /// Insert() reuses these, and Compact() gets rid of them.
+        void MarkRemoved(uintptr_t pos);
+        bool IsRemoved(uintptr_t pos) const { return left_to_value[pos] == Type(); }
+        unsigned RemovedCount() const { return removed_count; }
+        /// Moved(Type &val, uintptr_t new_pos) gets called for every live entry that gets moved
+        template <class Moved>
+        void Compact(Moved moved);
+        /// Like Add(), but reuses a nearby removed entry if there is one, only moving the entries between.
+        /// Returns position of the new entry.
+        template <class Moved>
+        uintptr_t Insert(Type &&val, const Rect16 &box, Moved moved);
 
         unsigned Size() const { return left_to_value.size(); }
         void Find(const Rect16 &rect, Type *out, Type **out_end);
         /// Only units with their 'position' inside the rect are counted
         template <class Func1, class Func2>
         Type *FindNearest(const Point &pos, const Rect16 &area, Func1 IsValid, Func2 Position);
+        /// Writes up to k closest values with their position inside area to out, and returns the amount.
+        /// They are sorted by distance, equally distant ones by their order in the arrays.
+        /// Position(val) must be inside the rect of val.
+        template <class Func1, class Func2>
+        int FindKNearest(const Point &pos, const Rect16 &area, int k, Type *out, Func1 IsValid, Func2 Position);
+        static const int MaxKNearest = 32;
         void Add(uintptr_t pos, Type &&val, const Rect16 &box);
 
     protected:
@@ -51,6 +118,16 @@ class PosSearch
         int NewFind(x32 left);
 
         x32 max_width;
+
+    private:
+        template <class Moved>
+        void MoveEntry(uintptr_t from, uintptr_t to, Moved moved);
+        /// True if the value at pos cannot have its position inside area's y range,
+        /// or if its position would be further than max_dist from point's y.
+        bool SkipByY(uintptr_t pos, const Point &point, const Rect16 &area, int max_dist) const;
+
+        static const uintptr_t ReuseDistance = 64;
+        unsigned removed_count;
 };
 
 class UnitSearch : protected PosSearch<Unit *>
@@ -59,6 +136,8 @@ class UnitSearch : protected PosSearch<Unit *>
         UnitSearch() {}
         UnitSearch(UnitSearch &&other) = default;
 
+        using PosSearch::MaxKNearest;
+
         template <class Func>
         Unit *FindNearest(const Point &pos, const Rect16 &area, Func IsValid) {
             // PosSearch::FindNearest returns nullptr/pointer to unit pointer,
@@ -68,6 +147,12 @@ class UnitSearch : protected PosSearch<Unit *>
             });
             return closest ? *closest : nullptr;
         }
+        template <class Func>
+        int FindKNearest(const Point &pos, const Rect16 &area, int k, Unit **out, Func IsValid) {
+            return PosSearch::FindKNearest(pos, area, k, out, IsValid, [](const Unit *a) {
+                return a->sprite->position;
+            });
+        }
 
         void Init();
         unsigned Size() const { return PosSearch::Size(); }
@@ -98,6 +183,8 @@ class MainUnitSearch : public UnitSearch
         // FindUnitBordersRect didn't include right and bottom coords in bw, so it won't cause issues
         // (No clue about more specialized functions)
         Unit **FindUnitsRect(const Rect16 &rect, int *amount = nullptr, Unit **out = nullptr);
+        /// Same as FindUnitsRect, but can use collision pairs if rect is close to unit's collision rect
+        Unit **FindUnitsNear(Unit *unit, const Rect16 &rect, int *amount, Unit **out = nullptr);
 
         // Bw compatibility functions
         Unit **FindUnitBordersRect(const Rect16 *rect);
@@ -110,6 +197,15 @@ class MainUnitSearch : public UnitSearch
         void ChangeUnitPosition_Fast(Unit *unit, int x_diff, int y_diff);
         void ChangeUnitPosition_Finish();
 
+        // Shadows UnitSearch::FindNearest to use the grid if it is enabled, defined in possearch.hpp
+        template <class Func>
+        Unit *FindNearest(const Point &pos, const Rect16 &area, Func IsValid);
+
+        /// See PosSearch::FindKNearest, k can be at most MaxKNearest. Equally distant units are ordered
+        /// by search_left, so the result is same with either backend.
+        template <class Func>
+        int FindKNearest(const Point &pos, const Rect16 &area, int k, Unit **out, Func IsValid);
+
         // Bw-compatible signature
         Unit *FindNearestUnit(Unit *self, const Point &pos, int (__fastcall *IsValid)(const Unit *, void *), void *func_param, const Rect16 &area_);
 
@@ -124,9 +220,29 @@ class MainUnitSearch : public UnitSearch
 
         UnitSearchRegionCache::Entry FindUnits_ChooseTarget(int region, bool ground);
         Unit **FindHelpingUnits(Unit *unit, const Rect16 &rect, TempMemoryPool *allocation_pool);
+        // Allows searching helping units of several nearby units at once: FindHelpingUnitCandidates
+        // is done with rect covering all of their areas, and FilterHelpingUnits then returns exactly
+        // what FindHelpingUnits would have returned.
+        Unit **FindHelpingUnitCandidates(const Rect16 &rect, TempMemoryPool *allocation_pool);
+        Unit **FilterHelpingUnits(Unit *unit, const Rect16 &rect, Unit **candidates, TempMemoryPool *allocation_pool);
         void ClearRegionCache();
+
+        /// Switches searches between the sorted arrays and UnitSearchGrid.
+        /// Both give identical results, and Debug builds verify that when grid is used.
+        void SetGridEnabled(bool enable);
+        bool IsGridEnabled() const { return grid_enabled; }
+
+        /// The cache is only used between these, but it is kept valid all the time,
+        /// so areas which have not changed can be used on later frames as well
         void EnableAreaCache();
         void DisableAreaCache();
+        AreaCacheStats TakeAreaCacheStats() { return area_cache.TakeStats(); }
+
+        /// Finds every pair of units that are close to each other. Changes made after this are
+        /// tracked, so FindUnitsNear can use the pairs until the next sweep.
+        void SweepCollisionPairs();
+        // Only counted with PerfTest, resets the counters
+        CollisionPairStats TakeCollisionPairStats();
 
         // Public for micro-optimizations, though FindUnitsRect should be good enough
         // out and bufs must be inited with arrays which is large enough,
@@ -153,6 +269,7 @@ class MainUnitSearch : public UnitSearch
         // Region cache works _always_ in FindUnits_ChooseTarget
         bool valid_region_cache;
         UnitSearchRegionCache region_cache;
+        RegionCacheStats TakeRegionCacheStats() { return region_units.TakeStats(); }
 
         template <class Filter, class Key, int N>
         void FillSecondaryCache(SecondaryAreaCache<Unit *, N> *cache, const Rect16 &area, Filter filter, Key key);
@@ -165,9 +282,45 @@ class MainUnitSearch : public UnitSearch
 
         bool area_cache_enabled;
         UnitSearchAreaCache area_cache;
+        UnitSearchRegionUnits region_units;
+        // Scratch space for FindUnits_ChooseTarget, kept to avoid allocating on every search
+        vector<uint32_t> choose_target_strength;
+        vector<Unit *> choose_target_sort_units;
+        vector<uint32_t> choose_target_sort_strength;
 
         void Validate();
 
+        Rect32 SearchRect(int pos) const
+        {
+            return Rect32(left_positions[pos], left_to_top[pos], left_to_right[pos], left_to_bottom[pos]);
+        }
+        bool UseGrid() const { return grid_enabled && grid.IsInited(); }
+        // Units touching the rect of a region for FindUnits_ChooseTarget, without any filtering
+        Unit **FindRegionUnits(const Rect16 &rect, Unit **out);
+        void SortChooseTargetUnits(Unit **units, uint32_t *strength, uint32_t count);
+        // Has to be called with the rect of every unit that gets added, removed or moved
+        void InvalidateCaches(const Rect32 &rect);
+        void RebuildGrid();
+        // Updates grid and area cache, has to be called before the arrays are updated
+        void UpdateMovedRect(Unit *unit, int x_diff, int y_diff);
+        // Same as PosSearch::Find, except that units with left < min_left are also skipped
+        void FindRect(const Rect16 &rect, Unit **out, Unit ***out_end);
+        Unit **GridFind(const Rect32 &rect, int min_left, Unit **out);
+        Unit **FindBorders(const Rect16 &rect, Unit **out, bool use_grid);
+        // Returns the units FindNearest could accept, in the order FindNearest would have checked them
+        Unit **GridFindNearestCandidates(const Point &pos, const Rect16 &area, Unit **out);
+
+        bool grid_enabled;
+        UnitSearchGrid grid;
+
+        int CollisionPairIndex(const Unit *unit) const;
+        bool ChangedAfterCollisionPairs(const Unit *unit) const;
+        void MarkChangedForCollisionPairs(Unit *unit);
+        bool FindFromCollisionPairs(Unit *unit, const Rect16 &rect, Unit **out, Unit ***out_end);
+
+        CollisionPairs collision_pairs;
+        CollisionPairStats collision_pair_stats;
+
         AreaCacheBuf reasonable_area_cache_buf[32 * 32];
 
         // ChangeUnitPosition_Fast uses these
@@ -129,6 +129,100 @@ UnitSearchRegionCache::Entry UnitSearchRegionCache::FinishEntry(Unit **arr, uint
     return Entry(raw, Limits::Players);
 }
 
+void UnitSearchRegionUnits::SetRegions(vector<Rect16> &&rects, xuint map_width, yuint map_height)
+{
+    bucket_width = ((int)map_width - 1) / (1 << BucketShift) + 1;
+    bucket_height = ((int)map_height - 1) / (1 << BucketShift) + 1;
+    buckets.clear();
+    buckets.resize(bucket_width * bucket_height);
+    regions.clear();
+    regions.resize(rects.size());
+    for (unsigned i = 0; i < rects.size(); i++)
+    {
+        const Rect16 &rect = rects[i];
+        regions[i].rect = rect;
+        int left = min(bucket_width - 1, (int)rect.left >> BucketShift);
+        int right = min(bucket_width - 1, max((int)rect.left, (int)rect.right - 1) >> BucketShift);
+        int top = min(bucket_height - 1, (int)rect.top >> BucketShift);
+        int bottom = min(bucket_height - 1, max((int)rect.top, (int)rect.bottom - 1) >> BucketShift);
+        for (int y = top; y <= bottom; y++)
+        {
+            for (int x = left; x <= right; x++)
+                buckets[y * bucket_width + x].emplace_back(i);
+        }
+    }
+}
+
+void UnitSearchRegionUnits::Clear()
+{
+    for (auto &region : regions)
+    {
+        region.valid = false;
+        region.units[0].clear();
+        region.units[1].clear();
+    }
+}
+
+void UnitSearchRegionUnits::Invalidate(const Rect32 &rect)
+{
+    if (bucket_width == 0)
+        return;
+    // Zero-sized rects still touch the regions they are inside of
+    int left = max(0, min(bucket_width - 1, (int)rect.left >> BucketShift));
+    int right = max(0, min(bucket_width - 1, max((int)rect.left, (int)rect.right - 1) >> BucketShift));
+    int top = max(0, min(bucket_height - 1, (int)rect.top >> BucketShift));
+    int bottom = max(0, min(bucket_height - 1, max((int)rect.top, (int)rect.bottom - 1) >> BucketShift));
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+        {
+            for (uint16_t region_id : buckets[y * bucket_width + x])
+            {
+                Region &region = regions[region_id];
+                if (!region.valid)
+                    continue;
+                // Same check as the search in FindUnits_ChooseTarget
+                const Rect16 &area = region.rect;
+                if (rect.right > (int)area.left && rect.left < (int)area.right &&
+                        rect.bottom > (int)area.top && rect.top < (int)area.bottom)
+                {
+                    region.valid = false;
+                    if (PerfTest)
+                        stats.invalidated++;
+                }
+            }
+        }
+    }
+}
+
+vector<Unit *> *UnitSearchRegionUnits::Find(int region_id, bool ground)
+{
+    Region &region = regions[region_id];
+    if (!region.valid)
+        return nullptr;
+    if (PerfTest)
+        stats.reused++;
+    return &region.units[ground ? 1 : 0];
+}
+
+vector<Unit *> *UnitSearchRegionUnits::Set(int region_id, bool ground, Unit **units, Unit **units_end)
+{
+    Region &region = regions[region_id];
+    region.units[0].assign(units, units_end);
+    region.units[1].assign(units, units_end);
+    region.valid = true;
+    if (PerfTest)
+        stats.rebuilds++;
+    return &region.units[ground ? 1 : 0];
+}
+
+RegionCacheStats UnitSearchRegionUnits::TakeStats()
+{
+    RegionCacheStats ret = stats;
+    stats = RegionCacheStats();
+    return ret;
+}
+
 template <typename T>
 unsigned Log2(T value)
 {
@@ -157,6 +251,42 @@ void UnitSearchAreaCache::Clear()
     }
     fill(cache.begin(), cache.end(), nullptr);
     for_each_buf.clear();
+    invalidated_since_clear = 0;
+    if (PerfTest)
+        stats.full_clears++;
+}
+
+void UnitSearchAreaCache::Invalidate(const Rect32 &rect)
+{
+    if (cache_size == 0)
+        return;
+    int stride = 1 << width_shift;
+    int rows = cache_size >> width_shift;
+    int left = max(0, min(stride - 1, rect.left / AreaSize));
+    int right = max(0, min(stride - 1, (rect.right - 1) / AreaSize));
+    int top = max(0, min(rows - 1, rect.top / AreaSize));
+    int bottom = max(0, min(rows - 1, (rect.bottom - 1) / AreaSize));
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+        {
+            auto &entry = cache[(y << width_shift) + x];
+            if (entry != nullptr)
+            {
+                entry = nullptr;
+                invalidated_since_clear++;
+                if (PerfTest)
+                    stats.areas_invalidated++;
+            }
+        }
+    }
+}
+
+AreaCacheStats UnitSearchAreaCache::TakeStats()
+{
+    AreaCacheStats ret = stats;
+    stats = AreaCacheStats();
+    return ret;
 }
 
 Rect16 UnitSearchAreaCache::GetNonCachedArea(const Rect16 &in) const
@@ -354,6 +484,9 @@ void UnitSearchAreaCache::FillCache(const Rect16 &rect, Array<Unit *> units)
     int bottomleft = ToCacheEntry(rect.left, rect.bottom - 1);
     int width = topright - topleft + 1;
     int height = ((bottomleft - topleft) >> width_shift) + 1;
+    STATIC_PERF_CLOCK(UnitSearch_AreaCacheFill);
+    if (PerfTest)
+        stats.areas_filled += width * height;
     auto max_width = *bw::unit_max_width;
     Assert(std::is_sorted(units.begin(), units.end(), [](Unit *a, Unit *b) { return a->GetCollisionRect().left < b->GetCollisionRect().left; }));
     for (int i = 0; i < width; i++)
@@ -378,6 +511,8 @@ void UnitSearchAreaCache::Find(const Rect16 &rect, Unit **out, Unit ***out_end,
     int raw_bottomleft = ToCacheEntry(rect.left, rect.bottom - 1);
     int raw_bottomright = ToCacheEntry(rect.right - 1, rect.bottom - 1);
     int raw_pos = raw_topleft;
+    if (PerfTest)
+        stats.areas_found += (raw_topright - raw_topleft + 1) * (((raw_bottomleft - raw_topleft) >> width_shift) + 1);
 
     bool left_aligned = rect.left % AreaSize == 0, top_aligned = rect.top % AreaSize == 0;
     bool right_aligned = rect.right % AreaSize == 0, bottom_aligned = rect.bottom % AreaSize == 0;
@@ -78,6 +78,72 @@ class UnitSearchRegionCache : public UnitSearchCache
         uint32_t size;
 };
 
+struct RegionCacheStats
+{
+    RegionCacheStats() : rebuilds(0), reused(0), resorts(0), invalidated(0) {}
+    // Regions which had to search the unit arrays
+    int rebuilds;
+    // Regions which used their units from an earlier frame
+    int reused;
+    // Regions whose units were no longer sorted by strength
+    int resorts;
+    int invalidated;
+};
+
+// Units which FindUnits_ChooseTarget found for each region, kept between frames.
+// UnitSearchRegionCache is cleared every frame, but the units of a region only have to be
+// searched again after a unit touching the region's rect has been added, removed or moved.
+// The units are kept in the order they were last sorted, which usually is still correct.
+class UnitSearchRegionUnits
+{
+    public:
+        UnitSearchRegionUnits() : bucket_width(0), bucket_height(0) {}
+        UnitSearchRegionUnits(UnitSearchRegionUnits &&other) = default;
+
+        void SetRegions(vector<Rect16> &&rects, xuint map_width, yuint map_height);
+        void Clear();
+        // Rect is an unit's search rect, before or after it changed
+        void Invalidate(const Rect32 &rect);
+
+        const Rect16 &RegionRect(int region) const { return regions[region].rect; }
+        // Returns the units in the order they were sorted last time for ground/air,
+        // or nullptr if they have to be searched and set again
+        vector<Unit *> *Find(int region, bool ground);
+        vector<Unit *> *Set(int region, bool ground, Unit **units, Unit **units_end);
+        void CountResort() { if (PerfTest) stats.resorts++; }
+
+        // Only counted with PerfTest, resets the counters
+        RegionCacheStats TakeStats();
+
+    private:
+        struct Region
+        {
+            Region() : valid(false) {}
+            Region(Region &&other) = default;
+            Rect16 rect;
+            bool valid;
+            // Indexed by ground
+            vector<Unit *> units[2];
+        };
+
+        static const int BucketShift = 8;
+        vector<Region> regions;
+        // Regions whose rect touches each 256x256 pixel bucket
+        vector<vector<uint16_t>> buckets;
+        int bucket_width;
+        int bucket_height;
+        RegionCacheStats stats;
+};
+
+struct AreaCacheStats
+{
+    AreaCacheStats() : areas_found(0), areas_filled(0), areas_invalidated(0), full_clears(0) {}
+    int areas_found;
+    int areas_filled;
+    int areas_invalidated;
+    int full_clears;
+};
+
 class UnitSearchAreaCache : public UnitSearchCache
 {
     public:
@@ -152,13 +218,23 @@ class UnitSearchAreaCache : public UnitSearchCache
         // Does not necessarily have to be constant, but currently Unit::GetAutoTarget cache
         // assumes that it can just take an area owned by this and fill its caches with one
         static const int AreaSize = 128;
-        UnitSearchAreaCache() {}
+        UnitSearchAreaCache() : width_shift(0), cache_size(0), invalidated_since_clear(0) {}
         UnitSearchAreaCache(UnitSearchAreaCache &&other) = default;
         UnitSearchAreaCache& operator=(UnitSearchAreaCache &&other) = default;
 
         void SetSize(xuint x, yuint y);
         void Clear();
 
+        /// Areas that rect touches get refilled when they are searched next time.
+        /// Rect may extend outside map.
+        void Invalidate(const Rect32 &rect);
+        /// Refilled areas are allocated again, and the old memory is only reused after Clear().
+        /// Once about as many areas as the map has have been invalidated, it is better to clear everything.
+        bool NeedsClear() const { return invalidated_since_clear > cache_size; }
+
+        // Only counted with PerfTest, resets the counters
+        AreaCacheStats TakeStats();
+
         unsigned int AreaAmount(const Rect16 &rect) const
         {
             // Rounds left and top upwards if not 0, right and bottom downwards if not AreaSize -1
@@ -218,6 +294,8 @@ class UnitSearchAreaCache : public UnitSearchCache
         Common::OwnedArray<Unit *> for_each_buf;
         uint32_t width_shift;
         uint32_t cache_size;
+        uint32_t invalidated_since_clear;
+        AreaCacheStats stats;
 };
 
 /// Cache that is designed to be used in more specialized situations than normal AreaCache,
@@ -0,0 +1,57 @@
+#include "unitsearch_grid.h"
+
+#include "console/assert.h"
+
+void UnitSearchGrid::SetSize(int map_width, int map_height)
+{
+    width = (map_width + (1 << CellShift) - 1) >> CellShift;
+    height = (map_height + (1 << CellShift) - 1) >> CellShift;
+    cells.clear();
+    cells.resize(width * height);
+}
+
+void UnitSearchGrid::Clear()
+{
+    for (auto &cell : cells)
+        cell.clear();
+}
+
+void UnitSearchGrid::Add(Unit *unit, const Rect32 &rect)
+{
+    int left = CellX(rect.left), right = CellX(rect.right - 1);
+    int top = CellY(rect.top), bottom = CellY(rect.bottom - 1);
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+            cells[y * width + x].emplace_back(unit);
+    }
+}
+
+void UnitSearchGrid::Remove(Unit *unit, const Rect32 &rect)
+{
+    int left = CellX(rect.left), right = CellX(rect.right - 1);
+    int top = CellY(rect.top), bottom = CellY(rect.bottom - 1);
+    for (int y = top; y <= bottom; y++)
+    {
+        for (int x = left; x <= right; x++)
+        {
+            auto &cell = cells[y * width + x];
+            auto it = std::find(cell.begin(), cell.end(), unit);
+            Assert(it != cell.end());
+            *it = cell.back();
+            cell.pop_back();
+        }
+    }
+}
+
+void UnitSearchGrid::Move(Unit *unit, const Rect32 &old_rect, const Rect32 &new_rect)
+{
+    // Most movement stays inside the same cells
+    if (CellX(old_rect.left) == CellX(new_rect.left) && CellX(old_rect.right - 1) == CellX(new_rect.right - 1) &&
+        CellY(old_rect.top) == CellY(new_rect.top) && CellY(old_rect.bottom - 1) == CellY(new_rect.bottom - 1))
+    {
+        return;
+    }
+    Remove(unit, old_rect);
+    Add(unit, new_rect);
+}
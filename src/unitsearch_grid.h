@@ -0,0 +1,70 @@
+#ifndef UNITSEARCH_GRID_H
+#define UNITSEARCH_GRID_H
+
+#include "types.h"
+
+#include <algorithm>
+
+// Alternative index for MainUnitSearch: each unit is stored in every 128x128 pixel cell
+// its collision rect touches. Unlike the sorted arrays, the cost of a search does not
+// depend on the widest unit in the map.
+// The grid only finds candidates, MainUnitSearch still checks them against its own
+// arrays and sorts them by search_left, so the results are identical to the array search.
+class UnitSearchGrid
+{
+    public:
+        UnitSearchGrid() : width(0), height(0) {}
+        UnitSearchGrid(UnitSearchGrid &&other) = default;
+
+        // Size is in pixels
+        void SetSize(int map_width, int map_height);
+        void Clear();
+
+        void Add(Unit *unit, const Rect32 &rect);
+        void Remove(Unit *unit, const Rect32 &rect);
+        void Move(Unit *unit, const Rect32 &old_rect, const Rect32 &new_rect);
+
+        // Calls func(unit, cell_x, cell_y) for every unit of every cell touched by rect.
+        // A unit in several cells is passed once per cell, the caller can use CellX/CellY
+        // to accept it only from one of them.
+        template <class Func>
+        void ForEachCandidate(const Rect32 &rect, Func func) const
+        {
+            // Searches with zero width/height still find units which cross the line
+            int left = CellX(rect.left), right = CellX(std::max((int)rect.left, (int)rect.right - 1));
+            int top = CellY(rect.top), bottom = CellY(std::max((int)rect.top, (int)rect.bottom - 1));
+            for (int y = top; y <= bottom; y++)
+            {
+                for (int x = left; x <= right; x++)
+                {
+                    for (Unit *unit : cells[y * width + x])
+                        func(unit, x, y);
+                }
+            }
+        }
+
+        template <class Func>
+        void ForEachInCell(int x, int y, Func func) const
+        {
+            for (Unit *unit : cells[y * width + x])
+                func(unit);
+        }
+
+        static const int CellSize = 1 << 7;
+
+        // Coordinates outside map are clamped to the border cells
+        int CellX(int x) const { return std::max(0, std::min(width - 1, x >> CellShift)); }
+        int CellY(int y) const { return std::max(0, std::min(height - 1, y >> CellShift)); }
+
+        bool IsInited() const { return width != 0; }
+
+    private:
+        static const int CellShift = 7;
+        static_assert(CellSize == 1 << CellShift, "Cell size");
+
+        vector<vector<Unit *>> cells;
+        int width;
+        int height;
+};
+
+#endif // UNITSEARCH_GRID_H